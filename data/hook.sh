@@ -1,12 +1,4 @@
 #!/bin/sh
-VERSION=""
-INDEX=0
-
-for i in $(seq 1 $BUNDLES); do
-    eval BUNDLE_VERSION=\$BUNDLE_VERSION_${i}
-    if [ "$BUNDLE_VERSION" \> "$VERSION" ]; then
-	VERSION="${BUNDLE_VERSION}"
-	INDEX="$i"
-    fi
-done
-exit $INDEX
+# Bundles are passed ordered by version, BUNDLE_BEST is the index of the
+# bundle with the highest version.
+exit ${BUNDLE_BEST:-0}
@@ -0,0 +1,31 @@
+#ifndef __RAUC_USB_UPDATER__ARCHIVE_H__
+#define __RAUC_USB_UPDATER__ARCHIVE_H__
+
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* File stored uncompressed in a zip or tar archive */
+typedef struct
+{
+	gchar *name;    /* path inside the archive */
+	goffset offset; /* offset of the data in the archive */
+	guint64 size;
+} ArchiveMember;
+
+void archive_member_free(ArchiveMember *member);
+
+GPtrArray *archive_list_members(const gchar *path,
+                                const gchar *suffix,
+                                GError **error);
+gchar *archive_extract_member(const gchar *path,
+                              const ArchiveMember *member,
+                              const gchar *dir,
+                              GCancellable *cancellable,
+                              GError **error);
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__ARCHIVE_H__
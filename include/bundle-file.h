@@ -0,0 +1,30 @@
+#ifndef __RAUC_USB_UPDATER__BUNDLE_FILE_H__
+#define __RAUC_USB_UPDATER__BUNDLE_FILE_H__
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean bundle_file_read_at(gint fd,
+                             gpointer buffer,
+                             gsize count,
+                             goffset offset,
+                             const gchar *path,
+                             GError **error);
+gboolean bundle_file_read_signature(const gchar *path,
+                                    guint64 *size,
+                                    GBytes **signature,
+                                    GError **error);
+gboolean bundle_file_read_signature_at(const gchar *path,
+                                       goffset offset,
+                                       guint64 size,
+                                       GBytes **signature,
+                                       GError **error);
+gchar *bundle_file_manifest_value(GBytes *signature,
+                                  const gchar *key);
+gchar *bundle_file_format(GBytes *signature);
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__BUNDLE_FILE_H__
@@ -0,0 +1,25 @@
+#ifndef __RAUC_USB_UPDATER__BYTE_ORDER_H__
+#define __RAUC_USB_UPDATER__BYTE_ORDER_H__
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Little endian fields of on-disk structures, without alignment */
+
+static inline guint16
+get_le16(const guint8 *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline guint32
+get_le32(const guint8 *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (guint32)p[3] << 24;
+}
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__BYTE_ORDER_H__
@@ -0,0 +1,23 @@
+#ifndef __RAUC_USB_UPDATER__CANDIDATES_H__
+#define __RAUC_USB_UPDATER__CANDIDATES_H__
+
+
+#include <glib.h>
+#include "de-helbling-disk-updater-gen.h"
+
+G_BEGIN_DECLS
+
+typedef struct _CandidateStore CandidateStore;
+
+CandidateStore *candidate_store_new(void);
+void candidate_store_free(CandidateStore *store);
+void candidate_store_add(CandidateStore *store,
+                         const gchar *disk_id,
+                         DiskUpdaterBundle *bundle);
+void candidate_store_remove_disk(CandidateStore *store, const gchar *disk_id);
+DiskUpdaterBundle *candidate_store_get_best(CandidateStore *store);
+GSList *candidate_store_list(CandidateStore *store);
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__CANDIDATES_H__
@@ -0,0 +1,80 @@
+#ifndef __RAUC_USB_UPDATER__CONFIG_H__
+#define __RAUC_USB_UPDATER__CONFIG_H__
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#ifndef CONFIG_FILE
+#define CONFIG_FILE "/etc/rauc-disk-updater.conf"
+#endif
+
+#define CONFIG_ERROR config_error_quark ()
+
+typedef enum
+{
+	CONFIG_ERROR_INVALID,
+} ConfigError;
+
+/**
+ * Settings of the daemon
+ *
+ * A Config is immutable once loaded. Consumers take a reference of the
+ * current configuration and keep it for the duration of an operation, so a
+ * reload never changes settings in the middle of a scan.
+ */
+typedef struct
+{
+	gint ref_count;
+
+	/* [settle] */
+	gdouble settle_timeout;     /* seconds without new partitions */
+
+	/* [mount] */
+	gchar *mount_base;          /* base directory of the mount points */
+	gchar *mount_options;       /* comma separated mount options */
+	gboolean mount_read_only;
+	gboolean prefetch_metadata; /* read FAT metadata ahead before the walk */
+
+	/* [scan] */
+	gchar *bundle_suffix;
+	guint scan_max_depth;       /* directory levels below a mount point */
+	guint scan_max_entries;     /* directory entries per device, 0 = no limit */
+	guint io_error_threshold;   /* media errors until a device fails, 0 = never */
+
+	/* [verification] */
+	gboolean check_compatible;
+	guint verify_timeout;       /* seconds per rauc call, 0 = D-Bus default */
+	gboolean verity_prevalidate; /* check the hash tree before rauc */
+	guint verity_threads;       /* hashing threads, 0 = one per processor */
+
+	/* [policy] */
+	gchar *script_file;
+	gchar *bundle_object_path;  /* base object path of published bundles */
+	gdouble decision_delay;     /* seconds after the last attach */
+
+	/* [resources] */
+	guint max_bundles;          /* bundles per device, 0 = no limit */
+	guint max_devices;          /* devices processed in parallel, 0 = no limit */
+	guint max_per_link;         /* devices processed per shared link, 0 = no limit */
+
+	/* [archive] */
+	gboolean archive_enabled;   /* search bundles inside zip and tar files */
+	gchar **archive_suffixes;
+	gchar *staging_dir;         /* extracted bundles, one directory per device */
+	guint max_staging_size;     /* MiB per device, 0 = free space only */
+} Config;
+
+GQuark config_error_quark (void);
+
+Config *config_new_default(void);
+Config *config_load(const gchar *file, GError **error);
+Config *config_ref(Config *config);
+void config_unref(Config *config);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(Config, config_unref)
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__CONFIG_H__
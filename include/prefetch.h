@@ -0,0 +1,15 @@
+#ifndef __RAUC_USB_UPDATER__PREFETCH_H__
+#define __RAUC_USB_UPDATER__PREFETCH_H__
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean prefetch_fat_metadata(const gchar *device_file,
+                               guint64 *bytes,
+                               GError **error);
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__PREFETCH_H__
@@ -0,0 +1,20 @@
+#ifndef __RAUC_USB_UPDATER__TIMELINE_H__
+#define __RAUC_USB_UPDATER__TIMELINE_H__
+
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _Timeline Timeline;
+
+Timeline *timeline_new(const gchar *session);
+void timeline_free(Timeline *timeline);
+void timeline_mark(Timeline *timeline, const gchar *stage, gint64 time);
+GVariant *timeline_serialize(Timeline *timeline);
+
+gint64 timeline_process_start(void);
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__TIMELINE_H__
@@ -5,16 +5,50 @@
 #include <glib.h>
 #include <glib-object.h>
 #include <gudev/gudev.h>
+#include "config.h"
 
 G_BEGIN_DECLS
 
 
+/* Monotonic timestamps of an attached disk, see g_get_monotonic_time() */
+typedef struct
+{
+	gint64 uevent;  /* disk added */
+	gint64 settled; /* no further partitions within the settle timeout */
+	gint64 mounted; /* all partitions mounted */
+} UdevTimes;
+
+typedef enum
+{
+	UDEV_BUS_OTHER,
+	UDEV_BUS_USB,
+	UDEV_BUS_MMC,
+} UdevBus;
+
+/* Position of a disk in the bus topology, see udev_device_get_topology() */
+typedef struct
+{
+	UdevBus bus;
+	gchar *link;      /* key of the link whose bandwidth the disk shares */
+	gchar *hub;       /* sysfs name of the upstream hub, NULL if none */
+	guint root_port;  /* port of the root hub, 0 if unknown */
+	gdouble speed;    /* negotiated speed in Mbit/s, 0 if unknown */
+} UdevTopology;
+
 #define UDEV_TYPE_MONITOR udev_monitor_get_type ()
 G_DECLARE_FINAL_TYPE (UdevMonitor, udev_monitor, UDEV, MONITOR, GObject)
 
 
 UdevMonitor *udev_monitor_new (void);
 void udev_monitor_quit(UdevMonitor *provider);
+void udev_monitor_set_config(UdevMonitor *self, Config *config);
+void udev_monitor_unmount(UdevMonitor *self, gpointer mount_points);
+guint udev_monitor_get_pending(UdevMonitor *self);
+
+void udev_device_get_topology(GUdevDevice *device, UdevTopology *topology);
+void udev_topology_clear(UdevTopology *topology);
+gchar *udev_device_get_disk_id(GUdevDevice *device);
+gdouble udev_device_get_expected_throughput(GUdevDevice *device);
 
 G_END_DECLS	
 
@@ -0,0 +1,27 @@
+#ifndef __RAUC_USB_UPDATER__VERITY_H__
+#define __RAUC_USB_UPDATER__VERITY_H__
+
+
+#include <glib.h>
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define VERITY_ERROR verity_error_quark ()
+
+typedef enum
+{
+	VERITY_ERROR_UNSUPPORTED, /* no verity bundle or unknown layout */
+	VERITY_ERROR_CORRUPT,     /* hash mismatch */
+} VerityError;
+
+GQuark verity_error_quark (void);
+
+gboolean verity_prevalidate(const gchar *path,
+                            guint threads,
+                            GCancellable *cancellable,
+                            GError **error);
+
+G_END_DECLS
+
+#endif // __RAUC_USB_UPDATER__VERITY_H__
@@ -0,0 +1,440 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file archive.c
+ * @date 2026-10-18
+ * @brief Bundles shipped inside uncompressed zip and tar archives
+ *
+ * Only members stored without compression are supported. Their data is a
+ * contiguous range of the archive, so a member is indexed by reading the
+ * archive headers only and extracted with a single sequential read.
+ *
+ * zip: The central directory at the end of the archive lists all members
+ *      with the offset of their local header. Zip64 archives, encrypted and
+ *      compressed members are skipped.
+ * tar: The ustar headers are read one after another, member data is skipped.
+ *      GNU long names are supported, pax headers are skipped.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "bundle-file.h"
+#include "byte-order.h"
+
+#define ZIP_LOCAL_MAGIC 0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_END_MAGIC 0x06054b50
+#define ZIP_END_SIZE 22
+#define ZIP_MAX_COMMENT 0xffff
+#define ZIP_MAX_DIRECTORY (16 * 1024 * 1024)
+
+#define TAR_BLOCK 512
+
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+/**
+ * @brief Frees an archive member
+ *
+ * @param[in] ArchiveMember struct
+ */
+void
+archive_member_free(ArchiveMember *member)
+{
+	g_free(member->name);
+	g_slice_free(ArchiveMember, member);
+}
+
+static ArchiveMember *
+new_member(const gchar *name, goffset offset, guint64 size)
+{
+	ArchiveMember *member = g_slice_new0(ArchiveMember);
+
+	member->name = g_strdup(name);
+	member->offset = offset;
+	member->size = size;
+	return member;
+}
+
+/**
+ * @brief Indexes the stored members of a zip archive
+ *
+ * @param[in] file descriptor of the archive
+ * @param[in] size of the archive
+ * @param[in] path of the archive
+ * @param[in] suffix of the members to index
+ * @param[in] array receiving the members
+ * @param[out] error
+ * @return TRUE on success
+ */
+static gboolean
+list_zip(gint fd, goffset size, const gchar *path, const gchar *suffix,
+         GPtrArray *members, GError **error)
+{
+	g_autofree guint8 *tail = NULL;
+	g_autofree guint8 *directory = NULL;
+	g_autofree gchar *name = NULL;
+	guint8 local[30];
+	gsize tail_size = MIN(size, ZIP_END_SIZE + ZIP_MAX_COMMENT);
+	const guint8 *end = NULL;
+	const guint8 *entry;
+	goffset data_offset;
+	guint32 dir_size, dir_offset, comp_size, data_size, header;
+	guint16 entries, method, flags, name_len, extra_len, comment_len;
+	gsize pos;
+	guint i;
+
+	tail = g_malloc(tail_size);
+	if (!bundle_file_read_at(fd, tail, tail_size, size - tail_size, path, error))
+		return FALSE;
+
+	/* the end of central directory record is followed by the comment */
+	for (pos = tail_size - ZIP_END_SIZE + 1; pos-- > 0;) {
+		if (get_le32(tail + pos) == ZIP_END_MAGIC) {
+			end = tail + pos;
+			break;
+		}
+	}
+	if (end == NULL) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		            "%s: no zip directory", path);
+		return FALSE;
+	}
+
+	entries = get_le16(end + 10);
+	dir_size = get_le32(end + 12);
+	dir_offset = get_le32(end + 16);
+	if (dir_offset == 0xffffffff || entries == 0xffff) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+		            "%s: zip64 archives are not supported", path);
+		return FALSE;
+	}
+	if (dir_size > ZIP_MAX_DIRECTORY || (goffset)dir_offset + dir_size > size) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		            "%s: invalid zip directory", path);
+		return FALSE;
+	}
+
+	directory = g_malloc(dir_size);
+	if (!bundle_file_read_at(fd, directory, dir_size, dir_offset, path, error))
+		return FALSE;
+
+	for (pos = 0, i = 0; i < entries; i++) {
+		if (pos + 46 > dir_size || get_le32(directory + pos) != ZIP_CENTRAL_MAGIC) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			            "%s: invalid zip directory entry", path);
+			return FALSE;
+		}
+		entry = directory + pos;
+		flags = get_le16(entry + 8);
+		method = get_le16(entry + 10);
+		comp_size = get_le32(entry + 20);
+		data_size = get_le32(entry + 24);
+		name_len = get_le16(entry + 28);
+		extra_len = get_le16(entry + 30);
+		comment_len = get_le16(entry + 32);
+		header = get_le32(entry + 42);
+		if (pos + 46 + name_len > dir_size) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			            "%s: invalid zip directory entry", path);
+			return FALSE;
+		}
+		pos += 46 + name_len + extra_len + comment_len;
+
+		g_free(name);
+		name = g_strndup((const gchar *)entry + 46, name_len);
+		if (!g_str_has_suffix(name, suffix))
+			continue;
+		if (method != 0 || comp_size != data_size || (flags & 0x1)) {
+			g_message("Skip compressed or encrypted member %s of %s",
+			          name, path);
+			continue;
+		}
+		if (comp_size == 0xffffffff || header == 0xffffffff) {
+			g_message("Skip zip64 member %s of %s", name, path);
+			continue;
+		}
+
+		/* the local header may have another extra field */
+		if ((goffset)header + sizeof(local) > size)
+			goto invalid;
+		if (!bundle_file_read_at(fd, local, sizeof(local), header, path, error))
+			return FALSE;
+		if (get_le32(local) != ZIP_LOCAL_MAGIC)
+			goto invalid;
+		data_offset = (goffset)header + sizeof(local) +
+		              get_le16(local + 26) + get_le16(local + 28);
+		if (data_offset + data_size > size)
+			goto invalid;
+		g_ptr_array_add(members, new_member(name, data_offset, data_size));
+	}
+	return TRUE;
+
+ invalid:
+	g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+	            "%s: invalid local header of %s", path, name);
+	return FALSE;
+}
+
+/**
+ * @brief Parses a numeric field of a tar header
+ *
+ * @param[in] field
+ * @param[in] length of the field
+ * @return value
+ */
+static guint64
+tar_number(const guint8 *field, gsize len)
+{
+	guint64 value = 0;
+	gsize i = 0;
+
+	if (field[0] & 0x80) {
+		/* GNU base-256 encoding for large files */
+		value = field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			value = value << 8 | field[i];
+		return value;
+	}
+
+	while (i < len && field[i] == ' ')
+		i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		value = value << 3 | (field[i] - '0');
+	return value;
+}
+
+/**
+ * @brief Verifies the checksum of a tar header
+ *
+ * @param[in] header block
+ * @return TRUE if the block is a valid header
+ */
+static gboolean
+tar_header_valid(const guint8 *header)
+{
+	guint64 sum = 0;
+	guint i;
+
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : header[i];
+	return sum == tar_number(header + 148, 8);
+}
+
+/**
+ * @brief Indexes the regular members of a tar archive
+ *
+ * @param[in] file descriptor of the archive
+ * @param[in] size of the archive
+ * @param[in] path of the archive
+ * @param[in] suffix of the members to index
+ * @param[in] array receiving the members
+ * @param[out] error
+ * @return TRUE on success
+ */
+static gboolean
+list_tar(gint fd, goffset size, const gchar *path, const gchar *suffix,
+         GPtrArray *members, GError **error)
+{
+	static const guint8 zero[TAR_BLOCK] = { 0 };
+	guint8 header[TAR_BLOCK];
+	g_autofree gchar *long_name = NULL;
+	g_autofree gchar *name = NULL;
+	goffset offset = 0;
+	guint64 data_size;
+	gchar type;
+
+	while (offset + TAR_BLOCK <= size) {
+		if (!bundle_file_read_at(fd, header, TAR_BLOCK, offset, path, error))
+			return FALSE;
+		if (memcmp(header, zero, TAR_BLOCK) == 0)
+			break; /* end of archive */
+		if (!tar_header_valid(header)) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			            "%s: invalid tar header at %" G_GOFFSET_FORMAT,
+			            path, offset);
+			return FALSE;
+		}
+
+		type = header[156];
+		data_size = tar_number(header + 124, 12);
+		offset += TAR_BLOCK;
+		if ((guint64)offset + data_size > (guint64)size) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			            "%s: truncated tar archive", path);
+			return FALSE;
+		}
+
+		g_free(name);
+		if (long_name) {
+			name = g_steal_pointer(&long_name);
+		} else if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+			name = g_strdup_printf("%.155s/%.100s",
+			                       (const gchar *)header + 345,
+			                       (const gchar *)header);
+		} else {
+			name = g_strndup((const gchar *)header, 100);
+		}
+
+		if (type == 'L') {
+			/* GNU long name of the following member */
+			long_name = g_malloc0(MIN(data_size, 4096) + 1);
+			if (!bundle_file_read_at(fd, long_name, MIN(data_size, 4096),
+			                         offset, path, error))
+				return FALSE;
+		} else if ((type == '0' || type == '\0') && g_str_has_suffix(name, suffix)) {
+			g_ptr_array_add(members, new_member(name, offset, data_size));
+		}
+
+		/* data is padded to full blocks */
+		offset += (data_size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Lists the stored members of an archive with a suffix
+ *
+ * The format is detected by the content, not by the file name.
+ *
+ * @param[in] path of the archive
+ * @param[in] suffix of the members to index
+ * @param[out] error
+ * @return Array of ArchiveMember or NULL on error or for unknown formats
+ */
+GPtrArray *
+archive_list_members(const gchar *path,
+                     const gchar *suffix,
+                     GError **error)
+{
+	g_autoptr(GPtrArray) members = NULL;
+	guint8 header[TAR_BLOCK];
+	struct stat st;
+	gboolean res;
+	gint errsv;
+	gint fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to open %s: %s", path, g_strerror(errsv));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	/* short files are zero padded for the format detection */
+	memset(header, 0, sizeof(header));
+	members = g_ptr_array_new_with_free_func((GDestroyNotify)archive_member_free);
+	if (!bundle_file_read_at(fd, header, MIN(st.st_size, TAR_BLOCK), 0,
+	                         path, error)) {
+		res = FALSE;
+	} else if (st.st_size >= ZIP_END_SIZE &&
+	           (get_le32(header) == ZIP_LOCAL_MAGIC ||
+	            get_le32(header) == ZIP_END_MAGIC)) {
+		res = list_zip(fd, st.st_size, path, suffix, members, error);
+	} else if (st.st_size >= TAR_BLOCK && tar_header_valid(header)) {
+		res = list_tar(fd, st.st_size, path, suffix, members, error);
+	} else {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+		            "%s: unknown archive format", path);
+		res = FALSE;
+	}
+	close(fd);
+
+	return res ? g_steal_pointer(&members) : NULL;
+}
+
+/**
+ * @brief Copies a member of an archive into a new file
+ *
+ * The member is read once with large sequential reads. The file is created
+ * with a unique name `XXXXXX-<member basename>` in the directory. On error
+ * or cancellation, the file is removed.
+ *
+ * @param[in] path of the archive
+ * @param[in] ArchiveMember
+ * @param[in] destination directory
+ * @param[in] cancellable
+ * @param[out] error
+ * @return path of the new file, free with g_free(), or NULL on error
+ */
+gchar *
+archive_extract_member(const gchar *path,
+                       const ArchiveMember *member,
+                       const gchar *dir,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+	g_autofree guint8 *buffer = g_malloc(COPY_BUFFER_SIZE);
+	g_autofree gchar *base = g_path_get_basename(member->name);
+	gchar *dest = g_strdup_printf("%s/XXXXXX-%s", dir, base);
+	guint64 remaining = member->size;
+	goffset offset = member->offset;
+	gboolean res = FALSE;
+	gsize chunk;
+	gssize written;
+	gint in_fd = -1;
+	gint out_fd = -1;
+	gint errsv;
+
+	in_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (in_fd < 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to open %s: %s", path, g_strerror(errsv));
+		goto out;
+	}
+	posix_fadvise(in_fd, offset, member->size, POSIX_FADV_SEQUENTIAL);
+
+	out_fd = g_mkstemp_full(dest, O_WRONLY | O_CLOEXEC, 0600);
+	if (out_fd < 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to create %s: %s", dest, g_strerror(errsv));
+		goto out;
+	}
+
+	while (remaining > 0) {
+		if (g_cancellable_set_error_if_cancelled(cancellable, error))
+			goto out;
+
+		chunk = MIN(remaining, COPY_BUFFER_SIZE);
+		if (!bundle_file_read_at(in_fd, buffer, chunk, offset, path, error))
+			goto out;
+
+		written = write(out_fd, buffer, chunk);
+		if (written != (gssize)chunk) {
+			errsv = written < 0 ? errno : ENOSPC;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+			            "Failed to write %s: %s", dest, g_strerror(errsv));
+			goto out;
+		}
+		offset += chunk;
+		remaining -= chunk;
+	}
+	res = TRUE;
+
+ out:
+	if (in_fd >= 0)
+		close(in_fd);
+	if (out_fd >= 0 && close(out_fd) != 0 && res) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to write %s: %s", dest, g_strerror(errsv));
+		res = FALSE;
+	}
+	if (!res && out_fd >= 0)
+		unlink(dest);
+	if (!res)
+		g_clear_pointer(&dest, g_free);
+	return dest;
+}
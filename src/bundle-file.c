@@ -0,0 +1,263 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file bundle-file.c
+ * @date 2026-10-18
+ * @brief Access to the trailer of rauc bundle files
+ *
+ * A rauc bundle consists of the payload (squashfs image, for verity bundles
+ * followed by the hash tree), the CMS signature and the size of the
+ * signature as 64 bit big endian integer:
+ *
+ * > +---------+-----------+----------------+
+ * > | payload | signature | signature size |
+ * > +---------+-----------+----------------+
+ *
+ * The signature covers the payload digest and the manifest, so its SHA-256
+ * identifies the content of a bundle without reading the payload. Verity
+ * bundles embed the manifest in the signature as plain text; crypt bundles
+ * wrap the signature in an encrypted CMS envelope.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+#include "bundle-file.h"
+
+#define MAX_SIGNATURE_SIZE (16 * 1024 * 1024)
+
+/* DER encoded OID 1.2.840.113549.1.7.3 (CMS EnvelopedData) */
+static const guint8 enveloped_data_oid[] = {
+	0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x03
+};
+
+/**
+ * @brief Reads exactly `count` bytes at an offset
+ *
+ * A read beyond the end of the file fails with G_IO_ERROR_INVALID_DATA, so
+ * truncated files are not mistaken for media errors.
+ *
+ * @param[in] file descriptor
+ * @param[out] buffer
+ * @param[in] number of bytes
+ * @param[in] file offset
+ * @param[in] path of the file for error messages
+ * @param[out] error, G_IO_ERROR with the errno based code
+ * @return TRUE on success
+ */
+gboolean
+bundle_file_read_at(gint fd, gpointer buffer, gsize count, goffset offset,
+                    const gchar *path, GError **error)
+{
+	gssize res;
+	gint errsv;
+
+	while (count > 0) {
+		res = pread(fd, buffer, count, offset);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res == 0) {
+			g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			            "Failed to read %s: unexpected end of file", path);
+			return FALSE;
+		}
+		if (res < 0) {
+			errsv = errno;
+			g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+			            "Failed to read %s: %s", path, g_strerror(errsv));
+			return FALSE;
+		}
+		buffer = (guint8 *)buffer + res;
+		count -= res;
+		offset += res;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Reads the signature trailer of a bundle stored in a file range
+ *
+ * @param[in] file descriptor
+ * @param[in] offset of the bundle in the file
+ * @param[in] size of the bundle
+ * @param[in] path of the file for error messages
+ * @param[out] signature (CMS, DER encoded), free with g_bytes_unref()
+ * @param[out] error
+ * @return TRUE on success
+ */
+static gboolean
+read_trailer(gint fd,
+             goffset offset,
+             guint64 size,
+             const gchar *path,
+             GBytes **signature,
+             GError **error)
+{
+	guint64 sig_size;
+	guint8 *sig = NULL;
+
+	if (size < sizeof(sig_size) ||
+	    !bundle_file_read_at(fd, &sig_size, sizeof(sig_size),
+	                offset + size - sizeof(sig_size), path, error))
+		goto invalid;
+
+	sig_size = GUINT64_FROM_BE(sig_size);
+	if (sig_size == 0 || sig_size > MAX_SIGNATURE_SIZE ||
+	    sig_size > size - sizeof(sig_size))
+		goto invalid;
+
+	sig = g_malloc(sig_size);
+	if (!bundle_file_read_at(fd, sig, sig_size,
+	                offset + size - sizeof(sig_size) - sig_size, path, error)) {
+		g_free(sig);
+		return FALSE;
+	}
+
+	*signature = g_bytes_new_take(sig, sig_size);
+	return TRUE;
+
+ invalid:
+	if (error == NULL || *error == NULL)
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		            "%s has no valid signature trailer", path);
+	return FALSE;
+}
+
+/**
+ * @brief Reads the signature of a bundle file
+ *
+ * @param[in] path to the bundle
+ * @param[out] size of the file
+ * @param[out] signature (CMS, DER encoded), free with g_bytes_unref()
+ * @param[out] error
+ * @return TRUE on success
+ */
+gboolean
+bundle_file_read_signature(const gchar *path,
+                           guint64 *size,
+                           GBytes **signature,
+                           GError **error)
+{
+	struct stat st;
+	gboolean res = FALSE;
+	gint errsv;
+	gint fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to open %s: %s", path, g_strerror(errsv));
+		goto out;
+	}
+
+	res = read_trailer(fd, 0, st.st_size, path, signature, error);
+	if (res)
+		*size = st.st_size;
+ out:
+	if (fd >= 0)
+		close(fd);
+	return res;
+}
+
+/**
+ * @brief Reads the signature of a bundle stored inside another file
+ *
+ * Used for bundles stored uncompressed in archives, the range is the data
+ * of the archive member.
+ *
+ * @param[in] path to the file
+ * @param[in] offset of the bundle in the file
+ * @param[in] size of the bundle
+ * @param[out] signature (CMS, DER encoded), free with g_bytes_unref()
+ * @param[out] error
+ * @return TRUE on success
+ */
+gboolean
+bundle_file_read_signature_at(const gchar *path,
+                              goffset offset,
+                              guint64 size,
+                              GBytes **signature,
+                              GError **error)
+{
+	gboolean res;
+	gint errsv;
+	gint fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to open %s: %s", path, g_strerror(errsv));
+		return FALSE;
+	}
+
+	res = read_trailer(fd, offset, size, path, signature, error);
+	close(fd);
+	return res;
+}
+
+/**
+ * @brief Looks up a value of the manifest embedded in the signature
+ *
+ * Only verity bundles embed the manifest readable, the signature of plain
+ * bundles covers the manifest stored in the image and the one of crypt
+ * bundles is encrypted. The signature is not verified here, so the values
+ * must not be trusted.
+ *
+ * @param[in] signature
+ * @param[in] key at the beginning of a line
+ * @return value, free with g_free(), or NULL if the key is missing
+ */
+gchar *
+bundle_file_manifest_value(GBytes *signature, const gchar *key)
+{
+	gsize size;
+	const gchar *data = g_bytes_get_data(signature, &size);
+	const gchar *end = data + size;
+	g_autofree gchar *needle = g_strdup_printf("\n%s=", key);
+	const gchar *value;
+	const gchar *p;
+
+	value = memmem(data, size, needle, strlen(needle));
+	if (value == NULL)
+		return NULL;
+
+	value += strlen(needle);
+	for (p = value; p < end && *p != '\n' && g_ascii_isprint(*p); p++);
+	return g_strstrip(g_strndup(value, p - value));
+}
+
+/**
+ * @brief Determines the format of a bundle from its signature
+ *
+ * The content type of an encrypted signature is EnvelopedData, it is the
+ * first element of the CMS. Verity bundles name their format in the
+ * embedded manifest, plain bundles embed no manifest.
+ *
+ * @param[in] signature
+ * @return "plain", "verity", "crypt" or the format named by the manifest,
+ *         free with g_free()
+ */
+gchar *
+bundle_file_format(GBytes *signature)
+{
+	gsize size;
+	const guint8 *data = g_bytes_get_data(signature, &size);
+	gchar *format;
+
+	/* ContentInfo header, length and contentType fit into 32 bytes */
+	if (memmem(data, MIN(size, 32), enveloped_data_oid,
+	           sizeof(enveloped_data_oid)))
+		return g_strdup("crypt");
+
+	format = bundle_file_manifest_value(signature, "format");
+	return format ? format : g_strdup("plain");
+}
@@ -0,0 +1,226 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file candidates.c
+ * @date 2026-10-18
+ * @brief Version ordered index of the bundles of all attached devices
+ *
+ * The bundles are kept in a GSequence (balanced tree) ordered by their
+ * parsed version, highest first. Ties are broken by the disk id and the path,
+ * so the order does not depend on the order of attaching. Adding a bundle or
+ * removing one costs O(log n), the best bundle is the first element.
+ *
+ * The store is not locked internally, the caller serializes the access.
+ *
+ * Versions are compared with strverscmp(), so numeric parts are compared by
+ * value (1.10 > 1.9). A pre-release suffix introduced by `-` or `~` sorts
+ * below the release (1.0-rc1 < 1.0), build metadata after `+` is ignored.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include "candidates.h"
+
+typedef struct
+{
+	DiskUpdaterBundle *bundle;
+	gchar *disk_id;
+	gchar *release; /* version without pre-release and build suffix */
+	gchar *pre_release; /* NULL for releases */
+} Candidate;
+
+struct _CandidateStore
+{
+	GSequence *sequence; /* Candidate, best first */
+	GHashTable *iters_by_disk; /* disk id -> GSList of GSequenceIter */
+};
+
+
+/**
+ * @brief Splits a version into release and pre-release part
+ *
+ * @param[in] Candidate struct receiving the parts
+ * @param[in] version string, may be NULL
+ */
+static void
+parse_version(Candidate *candidate, const gchar *version)
+{
+	gsize len;
+
+	if (version == NULL)
+		version = "";
+
+	len = strcspn(version, "-~+");
+	candidate->release = g_strndup(version, len);
+	if (version[len] == '-' || version[len] == '~') {
+		version += len + 1;
+		candidate->pre_release = g_strndup(version, strcspn(version, "+"));
+	}
+}
+
+/**
+ * @brief Compares two parsed versions
+ *
+ * @return <0, 0 or >0 if the version of a is lower, equal or higher
+ */
+static gint
+compare_parsed_versions(const Candidate *a, const Candidate *b)
+{
+	gint res = strverscmp(a->release, b->release);
+
+	if (res != 0)
+		return res;
+	if (a->pre_release == NULL || b->pre_release == NULL)
+		return (a->pre_release == NULL) - (b->pre_release == NULL);
+	return strverscmp(a->pre_release, b->pre_release);
+}
+
+/**
+ * @brief Sort function of the sequence, best candidate first
+ */
+static gint
+compare_candidates(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const Candidate *ca = a;
+	const Candidate *cb = b;
+	gint res;
+
+	res = compare_parsed_versions(cb, ca);
+	if (res != 0)
+		return res;
+	res = g_strcmp0(ca->disk_id, cb->disk_id);
+	if (res != 0)
+		return res;
+	return g_strcmp0(disk_updater_bundle_get_path(ca->bundle),
+	                 disk_updater_bundle_get_path(cb->bundle));
+}
+
+static void
+free_candidate(gpointer data)
+{
+	Candidate *candidate = data;
+
+	g_object_unref(candidate->bundle);
+	g_free(candidate->disk_id);
+	g_free(candidate->release);
+	g_free(candidate->pre_release);
+	g_slice_free(Candidate, candidate);
+}
+
+/**
+ * @brief Creates an empty store
+ *
+ * @return CandidateStore, free with candidate_store_free()
+ */
+CandidateStore *
+candidate_store_new(void)
+{
+	CandidateStore *store = g_slice_new0(CandidateStore);
+
+	store->sequence = g_sequence_new(free_candidate);
+	store->iters_by_disk = g_hash_table_new_full(g_str_hash,
+	                                             g_str_equal,
+	                                             g_free,
+	                                             (GDestroyNotify)g_slist_free);
+	return store;
+}
+
+/**
+ * @brief Frees the store and releases all bundles
+ *
+ * @param[in] CandidateStore
+ */
+void
+candidate_store_free(CandidateStore *store)
+{
+	g_hash_table_destroy(store->iters_by_disk);
+	g_sequence_free(store->sequence);
+	g_slice_free(CandidateStore, store);
+}
+
+/**
+ * @brief Adds a bundle of a disk
+ *
+ * @param[in] CandidateStore
+ * @param[in] disk id
+ * @param[in] bundle, a new reference is taken
+ */
+void
+candidate_store_add(CandidateStore *store,
+                    const gchar *disk_id,
+                    DiskUpdaterBundle *bundle)
+{
+	Candidate *candidate = g_slice_new0(Candidate);
+	GSequenceIter *iter;
+	GSList *iters = NULL;
+	gpointer key = NULL;
+
+	candidate->bundle = g_object_ref(bundle);
+	candidate->disk_id = g_strdup(disk_id);
+	parse_version(candidate, disk_updater_bundle_get_version(bundle));
+
+	iter = g_sequence_insert_sorted(store->sequence, candidate,
+	                                compare_candidates, NULL);
+
+	if (!g_hash_table_steal_extended(store->iters_by_disk, disk_id,
+	                                 &key, (gpointer *)&iters))
+		key = g_strdup(disk_id);
+	g_hash_table_insert(store->iters_by_disk, key, g_slist_prepend(iters, iter));
+}
+
+/**
+ * @brief Removes all bundles of a disk
+ *
+ * @param[in] CandidateStore
+ * @param[in] disk id
+ */
+void
+candidate_store_remove_disk(CandidateStore *store, const gchar *disk_id)
+{
+	GSList *iters = g_hash_table_lookup(store->iters_by_disk, disk_id);
+	GSList *item;
+
+	for (item = iters; item; item = g_slist_next(item))
+		g_sequence_remove(item->data);
+	g_hash_table_remove(store->iters_by_disk, disk_id);
+}
+
+/**
+ * @brief Returns the bundle with the highest version
+ *
+ * @param[in] CandidateStore
+ * @return bundle (no new reference) or NULL if the store is empty
+ */
+DiskUpdaterBundle *
+candidate_store_get_best(CandidateStore *store)
+{
+	GSequenceIter *iter = g_sequence_get_begin_iter(store->sequence);
+
+	if (g_sequence_iter_is_end(iter))
+		return NULL;
+	return ((Candidate *)g_sequence_get(iter))->bundle;
+}
+
+/**
+ * @brief Lists all bundles, best first
+ *
+ * @param[in] CandidateStore
+ * @return List of referenced bundles,
+ *         free with g_slist_free_full(list, g_object_unref)
+ */
+GSList *
+candidate_store_list(CandidateStore *store)
+{
+	GSequenceIter *iter = g_sequence_get_end_iter(store->sequence);
+	GSList *bundles = NULL;
+
+	while (!g_sequence_iter_is_begin(iter)) {
+		iter = g_sequence_iter_prev(iter);
+		bundles = g_slist_prepend(bundles,
+		                          g_object_ref(((Candidate *)g_sequence_get(iter))->bundle));
+	}
+	return bundles;
+}
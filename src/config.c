@@ -0,0 +1,459 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file config.c
+ * @date 2026-10-18
+ * @brief Keyfile based configuration of the daemon
+ *
+ * The configuration is read from the main file (CONFIG_FILE) and from all
+ * drop-ins `*.conf` in the directory `<main file>.d`. Drop-ins are applied in
+ * alphabetical order, later values override earlier ones. Missing files are
+ * not an error, the built-in defaults are used instead.
+ *
+ * Example:
+ * --------
+ *
+ * > [settle]
+ * > timeout=1.0
+ * >
+ * > [mount]
+ * > base-directory=/run/media/disk-updater
+ * > options=
+ * > read-only=false
+ * > prefetch-metadata=true
+ * >
+ * > [scan]
+ * > suffix=.raucb
+ * > max-depth=8
+ * > max-entries=0
+ * > io-error-threshold=3
+ * >
+ * > [verification]
+ * > check-compatible=true
+ * > timeout=0
+ * > prevalidate-verity=false
+ * > prevalidate-threads=0
+ * >
+ * > [policy]
+ * > script=/etc/rauc-disk-updater/hook.sh
+ * > bundle-object-path=/de/helbling/DiskUpdater/bundles
+ * > decision-delay=1.0
+ * >
+ * > [resources]
+ * > max-bundles=0
+ * > max-devices=4
+ * > max-per-link=1
+ * >
+ * > [archive]
+ * > enabled=true
+ * > suffixes=.zip;.tar
+ * > staging-directory=/var/tmp/rauc-disk-updater
+ * > max-staging-size=1024
+ */
+
+#include "config.h"
+
+G_DEFINE_QUARK (config-error-quark, config_error)
+
+/**
+ * @brief Creates a configuration with the built-in defaults
+ *
+ * @return Config with a reference count of one
+ */
+Config *
+config_new_default(void)
+{
+	Config *config = g_slice_new0(Config);
+
+	config->ref_count = 1;
+	config->settle_timeout = 1.0;
+	config->mount_base = g_strdup("/run/media/disk-updater");
+	config->mount_options = g_strdup("");
+	config->mount_read_only = FALSE;
+	config->prefetch_metadata = TRUE;
+	config->bundle_suffix = g_strdup(".raucb");
+	config->scan_max_depth = 8;
+	config->scan_max_entries = 0;
+	config->io_error_threshold = 3;
+	config->check_compatible = TRUE;
+	config->verify_timeout = 0;
+	config->verity_prevalidate = FALSE;
+	config->verity_threads = 0;
+	config->script_file = NULL;
+	config->bundle_object_path = g_strdup("/de/helbling/DiskUpdater/bundles");
+	config->decision_delay = 1.0;
+	config->max_bundles = 0;
+	config->max_devices = 4;
+	config->max_per_link = 1;
+	config->archive_enabled = TRUE;
+	config->archive_suffixes = g_strsplit(".zip;.tar", ";", -1);
+	config->staging_dir = g_strdup("/var/tmp/rauc-disk-updater");
+	config->max_staging_size = 1024;
+	return config;
+}
+
+/**
+ * @brief Increases the reference count
+ *
+ * @param[in] Config struct
+ * @return the same Config struct
+ */
+Config *
+config_ref(Config *config)
+{
+	g_atomic_int_inc(&config->ref_count);
+	return config;
+}
+
+/**
+ * @brief Decreases the reference count and frees the config if it drops to 0
+ *
+ * @param[in] Config struct
+ */
+void
+config_unref(Config *config)
+{
+	if (config == NULL || !g_atomic_int_dec_and_test(&config->ref_count))
+		return;
+
+	g_free(config->mount_base);
+	g_free(config->mount_options);
+	g_free(config->bundle_suffix);
+	g_free(config->script_file);
+	g_free(config->bundle_object_path);
+	g_strfreev(config->archive_suffixes);
+	g_free(config->staging_dir);
+	g_slice_free(Config, config);
+}
+
+/**
+ * @brief Copies all values of a key file into another key file
+ *
+ * @param[in] destination key file
+ * @param[in] source key file
+ */
+static void
+merge_key_file(GKeyFile *dest, GKeyFile *src)
+{
+	gchar **groups = g_key_file_get_groups(src, NULL);
+	gchar **keys;
+	gchar *value;
+	guint g, k;
+
+	for (g = 0; groups[g] != NULL; g++) {
+		keys = g_key_file_get_keys(src, groups[g], NULL, NULL);
+		for (k = 0; keys != NULL && keys[k] != NULL; k++) {
+			value = g_key_file_get_value(src, groups[g], keys[k], NULL);
+			g_key_file_set_value(dest, groups[g], keys[k], value);
+			g_free(value);
+		}
+		g_strfreev(keys);
+	}
+	g_strfreev(groups);
+}
+
+/**
+ * @brief Loads a file into a key file
+ *
+ * A missing file is silently ignored.
+ *
+ * @param[in] key file receiving the values
+ * @param[in] path to the file
+ * @param[out] error
+ * @return FALSE if the file exists, but could not be parsed
+ */
+static gboolean
+load_file(GKeyFile *key_file, const gchar *file, GError **error)
+{
+	g_autoptr(GKeyFile) part = g_key_file_new();
+	GError *local_error = NULL;
+
+	if (!g_key_file_load_from_file(part, file, G_KEY_FILE_NONE, &local_error)) {
+		if (g_error_matches(local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_clear_error(&local_error);
+			return TRUE;
+		}
+		g_propagate_prefixed_error(error, local_error, "%s: ", file);
+		return FALSE;
+	}
+
+	merge_key_file(key_file, part);
+	return TRUE;
+}
+
+/**
+ * @brief Compare function for sorting an array of file names
+ *
+ * @param[in] pointer to the first file name
+ * @param[in] pointer to the second file name
+ */
+static gint
+compare_file_names(gconstpointer a, gconstpointer b)
+{
+	return g_strcmp0(*(const gchar **)a, *(const gchar **)b);
+}
+
+/**
+ * @brief Loads all drop-ins of a directory in alphabetical order
+ *
+ * @param[in] key file receiving the values
+ * @param[in] drop-in directory
+ * @param[out] error
+ * @return FALSE if a drop-in could not be parsed
+ */
+static gboolean
+load_drop_ins(GKeyFile *key_file, const gchar *dir_path, GError **error)
+{
+	g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func(g_free);
+	const gchar *name;
+	GDir *dir;
+	guint i;
+
+	dir = g_dir_open(dir_path, 0, NULL);
+	if (dir == NULL)
+		return TRUE; /* no drop-ins */
+
+	while ((name = g_dir_read_name(dir))) {
+		if (g_str_has_suffix(name, ".conf"))
+			g_ptr_array_add(files, g_build_filename(dir_path, name, NULL));
+	}
+	g_dir_close(dir);
+
+	g_ptr_array_sort(files, compare_file_names);
+	for (i = 0; i < files->len; i++) {
+		if (!load_file(key_file, g_ptr_array_index(files, i), error))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Checks whether a key lookup failed only because the key is unset
+ *
+ * @param[in] error of a g_key_file_get_*() call
+ * @return TRUE if the default value should be kept
+ */
+static gboolean
+is_unset(GError *error)
+{
+	return g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_GROUP_NOT_FOUND) ||
+	       g_error_matches(error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_KEY_NOT_FOUND);
+}
+
+static gboolean
+get_string(GKeyFile *key_file, const gchar *group, const gchar *key,
+           gchar **value, GError **error)
+{
+	GError *local_error = NULL;
+	gchar *str = g_key_file_get_string(key_file, group, key, &local_error);
+
+	if (str == NULL) {
+		if (is_unset(local_error)) {
+			g_clear_error(&local_error);
+			return TRUE;
+		}
+		g_propagate_prefixed_error(error, local_error, "[%s] %s: ", group, key);
+		return FALSE;
+	}
+	g_free(*value);
+	*value = str;
+	return TRUE;
+}
+
+static gboolean
+get_string_list(GKeyFile *key_file, const gchar *group, const gchar *key,
+                gchar ***value, GError **error)
+{
+	GError *local_error = NULL;
+	gchar **list = g_key_file_get_string_list(key_file, group, key, NULL,
+	                                          &local_error);
+
+	if (local_error != NULL) {
+		if (is_unset(local_error)) {
+			g_clear_error(&local_error);
+			return TRUE;
+		}
+		g_propagate_prefixed_error(error, local_error, "[%s] %s: ", group, key);
+		return FALSE;
+	}
+	g_strfreev(*value);
+	*value = list ? list : g_new0(gchar *, 1);
+	return TRUE;
+}
+
+static gboolean
+get_boolean(GKeyFile *key_file, const gchar *group, const gchar *key,
+            gboolean *value, GError **error)
+{
+	GError *local_error = NULL;
+	gboolean res = g_key_file_get_boolean(key_file, group, key, &local_error);
+
+	if (local_error != NULL) {
+		if (is_unset(local_error)) {
+			g_clear_error(&local_error);
+			return TRUE;
+		}
+		g_propagate_prefixed_error(error, local_error, "[%s] %s: ", group, key);
+		return FALSE;
+	}
+	*value = res;
+	return TRUE;
+}
+
+static gboolean
+get_double(GKeyFile *key_file, const gchar *group, const gchar *key,
+           gdouble *value, GError **error)
+{
+	GError *local_error = NULL;
+	gdouble res = g_key_file_get_double(key_file, group, key, &local_error);
+
+	if (local_error != NULL) {
+		if (is_unset(local_error)) {
+			g_clear_error(&local_error);
+			return TRUE;
+		}
+		g_propagate_prefixed_error(error, local_error, "[%s] %s: ", group, key);
+		return FALSE;
+	}
+	*value = res;
+	return TRUE;
+}
+
+static gboolean
+get_uint(GKeyFile *key_file, const gchar *group, const gchar *key,
+         guint *value, GError **error)
+{
+	GError *local_error = NULL;
+	guint64 res = g_key_file_get_uint64(key_file, group, key, &local_error);
+
+	if (local_error != NULL) {
+		if (is_unset(local_error)) {
+			g_clear_error(&local_error);
+			return TRUE;
+		}
+		g_propagate_prefixed_error(error, local_error, "[%s] %s: ", group, key);
+		return FALSE;
+	}
+	if (res > G_MAXUINT) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[%s] %s: value %" G_GUINT64_FORMAT " out of range",
+		            group, key, res);
+		return FALSE;
+	}
+	*value = (guint)res;
+	return TRUE;
+}
+
+/**
+ * @brief Checks the values of a configuration for consistency
+ *
+ * @param[in] Config struct
+ * @param[out] error
+ * @return TRUE if the configuration is usable
+ */
+static gboolean
+config_validate(Config *config, GError **error)
+{
+	if (config->settle_timeout <= 0.0 || config->settle_timeout > 60.0) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[settle] timeout must be in (0, 60] seconds");
+		return FALSE;
+	}
+	if (!g_path_is_absolute(config->mount_base)) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[mount] base-directory must be an absolute path");
+		return FALSE;
+	}
+	if (config->bundle_suffix[0] == '\0') {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[scan] suffix must not be empty");
+		return FALSE;
+	}
+	if (config->script_file != NULL && config->script_file[0] == '\0') {
+		/* an empty value disables the hook */
+		g_clear_pointer(&config->script_file, g_free);
+	}
+	if (config->script_file != NULL &&
+	    !g_file_test(config->script_file, G_FILE_TEST_EXISTS)) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[policy] script: no such file %s", config->script_file);
+		return FALSE;
+	}
+	if (!g_variant_is_object_path(config->bundle_object_path) ||
+	    g_strcmp0(config->bundle_object_path, "/") == 0) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[policy] bundle-object-path is not a valid object path");
+		return FALSE;
+	}
+	if (config->decision_delay < 0.0 || config->decision_delay > 60.0) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[policy] decision-delay must be in [0, 60] seconds");
+		return FALSE;
+	}
+	if (config->max_devices > 64) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[resources] max-devices must be in [0, 64]");
+		return FALSE;
+	}
+	if (config->archive_enabled && !g_path_is_absolute(config->staging_dir)) {
+		g_set_error(error, CONFIG_ERROR, CONFIG_ERROR_INVALID,
+		            "[archive] staging-directory must be an absolute path");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Loads the configuration from a file and its drop-in directory
+ *
+ * @param[in] path to the main configuration file
+ * @param[out] error
+ * @return new Config or NULL on error
+ */
+Config *
+config_load(const gchar *file, GError **error)
+{
+	g_autoptr(GKeyFile) key_file = g_key_file_new();
+	g_autofree gchar *drop_in_dir = g_strdup_printf("%s.d", file);
+	Config *config = config_new_default();
+
+	if (!load_file(key_file, file, error) ||
+	    !load_drop_ins(key_file, drop_in_dir, error))
+		goto err;
+
+	if (!get_double(key_file, "settle", "timeout", &config->settle_timeout, error) ||
+	    !get_string(key_file, "mount", "base-directory", &config->mount_base, error) ||
+	    !get_string(key_file, "mount", "options", &config->mount_options, error) ||
+	    !get_boolean(key_file, "mount", "read-only", &config->mount_read_only, error) ||
+	    !get_boolean(key_file, "mount", "prefetch-metadata", &config->prefetch_metadata, error) ||
+	    !get_string(key_file, "scan", "suffix", &config->bundle_suffix, error) ||
+	    !get_uint(key_file, "scan", "max-depth", &config->scan_max_depth, error) ||
+	    !get_uint(key_file, "scan", "max-entries", &config->scan_max_entries, error) ||
+	    !get_uint(key_file, "scan", "io-error-threshold", &config->io_error_threshold, error) ||
+	    !get_boolean(key_file, "verification", "check-compatible", &config->check_compatible, error) ||
+	    !get_uint(key_file, "verification", "timeout", &config->verify_timeout, error) ||
+	    !get_boolean(key_file, "verification", "prevalidate-verity", &config->verity_prevalidate, error) ||
+	    !get_uint(key_file, "verification", "prevalidate-threads", &config->verity_threads, error) ||
+	    !get_string(key_file, "policy", "script", &config->script_file, error) ||
+	    !get_string(key_file, "policy", "bundle-object-path", &config->bundle_object_path, error) ||
+	    !get_double(key_file, "policy", "decision-delay", &config->decision_delay, error) ||
+	    !get_uint(key_file, "resources", "max-bundles", &config->max_bundles, error) ||
+	    !get_uint(key_file, "resources", "max-devices", &config->max_devices, error) ||
+	    !get_uint(key_file, "resources", "max-per-link", &config->max_per_link, error) ||
+	    !get_boolean(key_file, "archive", "enabled", &config->archive_enabled, error) ||
+	    !get_string_list(key_file, "archive", "suffixes", &config->archive_suffixes, error) ||
+	    !get_string(key_file, "archive", "staging-directory", &config->staging_dir, error) ||
+	    !get_uint(key_file, "archive", "max-staging-size", &config->max_staging_size, error))
+		goto err;
+
+	if (!config_validate(config, error))
+		goto err;
+
+	return config;
+
+ err:
+	config_unref(config);
+	return NULL;
+}
@@ -0,0 +1,117 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file prefetch.c
+ * @date 2026-10-18
+ * @brief Read-ahead of the metadata of FAT filesystems
+ *
+ * Walking a FAT filesystem reads the allocation table and the directory
+ * clusters in small pieces. On USB sticks every piece is a round trip of the
+ * bus. The kernel keeps the metadata of a mounted filesystem in the page
+ * cache of its block device, so reading the first allocation table and the
+ * root directory ahead with large requests turns these round trips into
+ * cache hits:
+ *
+ * > +----------+-------+-------+----------+-----------------------+
+ * > | reserved | FAT 1 | FAT 2 | root dir | data (FAT32 root dir) |
+ * > +----------+-------+-------+----------+-----------------------+
+ *
+ * The read-ahead has to be issued after the mount: mounting sets the block
+ * size of the device (e.g. 512 bytes for FAT), which writes back and drops
+ * the pages cached before. It does not wait for the reads to complete.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include "byte-order.h"
+#include "prefetch.h"
+
+#define MAX_PREFETCH_SIZE (64 * 1024 * 1024)
+
+/**
+ * @brief Reads the allocation table and the root directory of a FAT partition ahead
+ *
+ * @param[in] device file of the partition
+ * @param[out] number of bytes read ahead
+ * @param[out] error, G_IO_ERROR
+ * @return TRUE on success
+ */
+gboolean
+prefetch_fat_metadata(const gchar *device_file,
+                      guint64 *bytes,
+                      GError **error)
+{
+	guint8 boot[512];
+	guint64 sector_size, fat_start, fat_size, root_start, root_size;
+	guint32 sectors_per_cluster, reserved, fats, root_entries, fat_sectors;
+	gboolean res = FALSE;
+	gssize count;
+	gint errsv;
+	gint fd;
+
+	fd = open(device_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to open %s: %s", device_file, g_strerror(errsv));
+		return FALSE;
+	}
+
+	count = pread(fd, boot, sizeof(boot), 0);
+	if (count != sizeof(boot)) {
+		errsv = count < 0 ? errno : EIO;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to read %s: %s", device_file, g_strerror(errsv));
+		goto out;
+	}
+
+	sector_size = get_le16(boot + 11);
+	sectors_per_cluster = boot[13];
+	reserved = get_le16(boot + 14);
+	fats = boot[16];
+	root_entries = get_le16(boot + 17);
+	fat_sectors = get_le16(boot + 22);
+	if (fat_sectors == 0)
+		fat_sectors = get_le32(boot + 36); /* FAT32 */
+
+	if (boot[510] != 0x55 || boot[511] != 0xaa ||
+	    sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1)) ||
+	    sectors_per_cluster == 0 || reserved == 0 || fats == 0 || fat_sectors == 0) {
+		g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		            "%s has no FAT boot sector", device_file);
+		goto out;
+	}
+
+	/* the kernel only reads the first table */
+	fat_start = reserved * sector_size;
+	fat_size = MIN((guint64)fat_sectors * sector_size, MAX_PREFETCH_SIZE);
+
+	root_start = fat_start + (guint64)fats * fat_sectors * sector_size;
+	if (root_entries) {
+		/* FAT12/16: fixed root directory behind the tables */
+		root_size = (guint64)root_entries * 32;
+	} else if (get_le32(boot + 44) >= 2) {
+		/* FAT32: the root directory is a cluster chain, read its first cluster */
+		root_start += ((guint64)get_le32(boot + 44) - 2) *
+		              sectors_per_cluster * sector_size;
+		root_size = (guint64)sectors_per_cluster * sector_size;
+	} else {
+		root_size = 0;
+	}
+
+	readahead(fd, fat_start, fat_size);
+	if (root_size)
+		posix_fadvise(fd, root_start, root_size, POSIX_FADV_WILLNEED);
+	*bytes = fat_size + root_size;
+	res = TRUE;
+
+ out:
+	close(fd);
+	return res;
+}
@@ -18,10 +18,19 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <glib-unix.h>
 #include <glib.h>
 
+#include "archive.h"
+#include "bundle-file.h"
+#include "candidates.h"
+#include "config.h"
+#include "timeline.h"
 #include "udev.h"
+#include "verity.h"
 #include "de-helbling-disk-updater-gen.h"
 #include "de-pengutronix-rauc-gen.h"
 
@@ -29,12 +38,26 @@
 
 static gboolean opt_version = FALSE;
 static gchar *script_file = NULL;
+static gchar *config_file = NULL;
 
-#define DISK_ID(d) g_udev_device_get_property(device, "ID_PART_TABLE_UUID")
-#define NEW_DISK_ID(d) g_strdup(DISK_ID(d))
 
 typedef DiskUpdaterBundle Bundle;
 
+typedef struct
+{
+	gdouble expected; /* bytes per second rated from the bus */
+	gdouble measured; /* bytes per second of verifications, 0 if unknown */
+	GCancellable *cancellable; /* cancelled when the disk is removed */
+} Medium;
+
+typedef struct
+{
+	gchar *path;
+	gchar *disk_id;
+	gdouble throughput; /* bytes per second */
+	GCancellable *cancellable; /* of the medium */
+} Source;
+
 typedef struct
 {
 	GMainLoop *loop;
@@ -44,159 +67,1188 @@ typedef struct
 	UdevMonitor *monitor;
 	RaucInstaller *installer;
 	gchar *compatible; /* system compatible */
+	GMutex info_lock; /* serializes the rauc Info calls of the scans */
+
+	GMutex lock; /* protects everything below */
+	Config *config;
+	GHashTable *failing_disks; /* disk ids of devices with media errors */
 
-	guint bundle_dbus_count;
+	guint64 generation; /* changes of the exported bundle objects */
 	guint device_count;
+	guint scan_count; /* devices currently scanned */
 	
 	GHashTable *bundles_by_disk;
+	GHashTable *exported; /* object path -> GSList of copies (ref), first exported */
+	CandidateStore *candidates; /* bundles of all disks by version */
+	Bundle *best_bundle;
+	GHashTable *timelines; /* "startup" and disk id -> Timeline */
+	GHashTable *media; /* disk id -> Medium */
+
+	guint decision_timeout; /* debounce timer of the next decision */
+	gboolean decision_pending; /* attach during a running decision */
+	GThread *decision_thread;
+	GCancellable *decision_cancellable;
 } MainContext;
 
+typedef struct
+{
+	MainContext *context;
+	Config *config;
+	const gchar *disk_id;
+	Medium *medium;
+	GCancellable *cancellable;
+	guint entries; /* directory entries visited */
+	guint bundles; /* bundles found */
+	guint64 staged_size; /* bytes extracted from archives */
+	guint io_errors; /* media errors (EIO, ETIMEDOUT, ...) */
+	gboolean failing; /* io_error_threshold reached, scan aborted */
+} Scan;
+
+
+/* Commandline options */
+static GOptionEntry entries[] =
+	{
+	 { "config", 'c', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &config_file,
+	   "Configuration file", NULL },
+	 { "script", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &script_file,
+	   "Script file (overrides the configuration)", NULL },
+	 { "version", 'v', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_version,
+	   "Version information", NULL },
+	 { NULL }
+	};
+
+/**
+ * @brief Returns a reference of the current configuration
+ *
+ * @param[in] MainContext struct
+ * @return Config struct, release with config_unref()
+ */
+static Config *
+get_config(MainContext *context)
+{
+	Config *config;
+
+	g_mutex_lock(&context->lock);
+	config = config_ref(context->config);
+	g_mutex_unlock(&context->lock);
+	return config;
+}
+
+/**
+ * @brief Makes a configuration the active one
+ *
+ * The switch is atomic for all consumers: every scan holds the reference it
+ * started with. Attached devices and published bundles are not touched, new
+ * settings apply to the next scan.
+ *
+ * @param[in] MainContext struct
+ * @param[in] Config struct, a new reference is taken
+ */
+static void
+apply_config(MainContext *context, Config *config)
+{
+	Config *old;
+
+	g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(context->installer),
+	                                 config->verify_timeout ?
+	                                 (gint)config->verify_timeout * 1000 : -1);
+	udev_monitor_set_config(context->monitor, config);
+
+	g_mutex_lock(&context->lock);
+	old = context->config;
+	context->config = config_ref(config);
+	g_mutex_unlock(&context->lock);
+	if (old)
+		config_unref(old);
+}
+
+/**
+ * @brief Loads the configuration again and applies it
+ *
+ * On failure the current configuration is kept.
+ *
+ * @param[in] MainContext struct
+ * @param[out] error
+ * @return TRUE if the new configuration is active
+ */
+static gboolean
+reload_config(MainContext *context, GError **error)
+{
+	g_autoptr(Config) config = NULL;
+
+	config = config_load(config_file ? config_file : CONFIG_FILE, error);
+	if (config == NULL)
+		return FALSE;
+
+	apply_config(context, config);
+	g_message("Configuration reloaded");
+	return TRUE;
+}
+
+/**
+ * @brief Publishes the timelines of all sessions on dbus
+ *
+ * Call with the context lock held.
+ *
+ * @param[in] MainContext struct
+ */
+static void
+publish_timelines(MainContext *context)
+{
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	if (context->disk_updater == NULL)
+		return; /* published once the bus is acquired */
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sa(st)}"));
+	g_hash_table_iter_init(&iter, context->timelines);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		g_variant_builder_add(&builder, "{s@a(st)}",
+		                      (const gchar *)key,
+		                      timeline_serialize(value));
+	disk_updater_set_timeline(context->disk_updater,
+	                          g_variant_builder_end(&builder));
+}
+
+/**
+ * @brief Records a stage of a session
+ *
+ * Call with the context lock held. A missing session is created.
+ *
+ * @param[in] MainContext struct
+ * @param[in] name of the session
+ * @param[in] name of the stage, must be a static string
+ * @param[in] monotonic time of the stage
+ */
+static void
+mark_stage_locked(MainContext *context,
+                  const gchar *session,
+                  const gchar *stage,
+                  gint64 time)
+{
+	Timeline *timeline = g_hash_table_lookup(context->timelines, session);
+
+	if (timeline == NULL) {
+		timeline = timeline_new(session);
+		g_hash_table_insert(context->timelines, g_strdup(session), timeline);
+	}
+	timeline_mark(timeline, stage, time);
+	publish_timelines(context);
+}
+
+/**
+ * @brief Records a stage of a session
+ *
+ * @param[in] MainContext struct
+ * @param[in] name of the session
+ * @param[in] name of the stage, must be a static string
+ * @param[in] monotonic time of the stage
+ */
+static void
+mark_stage(MainContext *context,
+           const gchar *session,
+           const gchar *stage,
+           gint64 time)
+{
+	g_mutex_lock(&context->lock);
+	mark_stage_locked(context, session, stage, time);
+	g_mutex_unlock(&context->lock);
+}
+
+/**
+ * @brief Records a stage in the sessions of all attached disks
+ *
+ * Used for the stages following the scans, which concern all disks.
+ *
+ * @param[in] MainContext struct
+ * @param[in] name of the stage, must be a static string
+ */
+static void
+mark_attached(MainContext *context, const gchar *stage)
+{
+	gint64 time = g_get_monotonic_time();
+	GHashTableIter iter;
+	gpointer key;
+
+	g_mutex_lock(&context->lock);
+	g_hash_table_iter_init(&iter, context->bundles_by_disk);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		mark_stage_locked(context, key, stage, time);
+	g_mutex_unlock(&context->lock);
+}
+
+/**
+ * @brief Callback of dbus interface for reloading the configuration
+ *
+ * @param[in] disk updater interface
+ * @param[in] dbus method invocation
+ * @param[in] MainContext struct
+ */
+static gboolean
+on_dbus_reload (DiskUpdater *interface,
+                GDBusMethodInvocation *invocation,
+                gpointer user_data)
+{
+	MainContext *context = (MainContext*) user_data;
+	GError *error = NULL;
+
+	if (!reload_config(context, &error)) {
+		g_warning("Failed to reload configuration: %s", error->message);
+		g_dbus_method_invocation_take_error(invocation, error);
+	} else {
+		disk_updater_complete_reload(interface, invocation);
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Returns the throughput of a medium
+ *
+ * @param[in] Medium struct or NULL
+ * @return measured or else expected throughput in bytes per second
+ */
+static gdouble
+medium_throughput(Medium *medium)
+{
+	if (medium == NULL)
+		return 0;
+	return medium->measured > 0 ? medium->measured : medium->expected;
+}
+
+static void
+free_medium(gpointer data)
+{
+	Medium *medium = data;
+
+	g_object_unref(medium->cancellable);
+	g_free(medium);
+}
+
+static void
+free_source(gpointer data)
+{
+	Source *source = data;
+
+	g_free(source->path);
+	g_free(source->disk_id);
+	g_clear_object(&source->cancellable);
+	g_slice_free(Source, source);
+}
+
+/**
+ * @brief Sort function for sources, fastest first
+ */
+static gint
+compare_sources(gconstpointer a, gconstpointer b)
+{
+	const Source *sa = *(const Source **)a;
+	const Source *sb = *(const Source **)b;
+
+	if (sa->throughput != sb->throughput)
+		return sa->throughput < sb->throughput ? 1 : -1;
+	return g_strcmp0(sa->disk_id, sb->disk_id);
+}
+
+/**
+ * @brief Checks whether two bundles are copies of the same file
+ *
+ * @param[in] first bundle
+ * @param[in] second bundle
+ * @return TRUE if size and fingerprint match
+ */
+static gboolean
+is_same_bundle(Bundle *a, Bundle *b)
+{
+	const gchar *fingerprint = disk_updater_bundle_get_fingerprint(a);
+
+	if (a == b)
+		return TRUE;
+	if (fingerprint == NULL || fingerprint[0] == '\0')
+		return FALSE;
+	return disk_updater_bundle_get_size(a) == disk_updater_bundle_get_size(b) &&
+	       g_strcmp0(fingerprint, disk_updater_bundle_get_fingerprint(b)) == 0;
+}
+
+/**
+ * @brief Resolves a bundle to all identical copies on the attached media
+ *
+ * @param[in] MainContext struct
+ * @param[in] bundle
+ * @return Array of Source, fastest medium first
+ */
+static GPtrArray *
+resolve_sources(MainContext *context, Bundle *bundle)
+{
+	GPtrArray *sources = g_ptr_array_new_with_free_func(free_source);
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *item;
+	Source *source;
+	Medium *medium;
+
+	g_mutex_lock(&context->lock);
+	g_hash_table_iter_init(&iter, context->bundles_by_disk);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		for (item = value; item; item = g_slist_next(item)) {
+			if (!is_same_bundle(bundle, item->data))
+				continue;
+			source = g_slice_new0(Source);
+			source->path = g_strdup(disk_updater_bundle_get_path(item->data));
+			source->disk_id = g_strdup(key);
+			medium = g_hash_table_lookup(context->media, key);
+			source->throughput = medium_throughput(medium);
+			if (medium)
+				source->cancellable = g_object_ref(medium->cancellable);
+			g_ptr_array_add(sources, source);
+		}
+	}
+	g_mutex_unlock(&context->lock);
+
+	g_ptr_array_sort(sources, compare_sources);
+	return sources;
+}
+
+/**
+ * @brief Removes an extracted bundle and its staging directory once empty
+ *
+ * Destroy notify of the "staged-file" data of a bundle, called when the last
+ * reference of the bundle is dropped.
+ *
+ * @param[in] path of the extracted file
+ */
+static void
+unlink_staged_file(gpointer data)
+{
+	g_autofree gchar *dir = g_path_get_dirname(data);
+
+	if (unlink(data) != 0 && errno != ENOENT)
+		g_warning("Could not remove %s: %s", (gchar *)data, g_strerror(errno));
+	g_rmdir(dir); /* fails while other bundles of the device are staged */
+	g_free(data);
+}
+
+/**
+ * @brief Cancels the cancellable passed as data
+ *
+ * Callback of g_cancellable_connect().
+ */
+static void
+forward_cancel(GCancellable *cancellable, gpointer data)
+{
+	g_cancellable_cancel(G_CANCELLABLE(data));
+}
+
+/**
+ * @brief Installs a bundle from the fastest medium holding a copy
+ *
+ * If the medium of a copy was removed before the installation starts, the
+ * next copy is used. Removing the medium of the used copy cancels the call.
+ *
+ * @param[in] MainContext struct
+ * @param[in] bundle
+ * @param[in] cancellable
+ * @param[out] error
+ * @return TRUE on success
+ */
+static gboolean
+install_bundle(MainContext *context,
+               Bundle *bundle,
+               GCancellable *cancellable,
+               GError **error)
+{
+	g_autoptr(GPtrArray) sources = resolve_sources(context, bundle);
+	g_autoptr(GCancellable) install = NULL;
+	gulong medium_handler, caller_handler = 0;
+	Source *source;
+	gboolean present;
+	gboolean res;
+	guint i;
+
+	for (i = 0; i < sources->len; i++) {
+		source = g_ptr_array_index(sources, i);
+
+		g_mutex_lock(&context->lock);
+		present = g_hash_table_contains(context->bundles_by_disk, source->disk_id) &&
+		          !g_hash_table_contains(context->failing_disks, source->disk_id);
+		g_mutex_unlock(&context->lock);
+		if (!present || !g_file_test(source->path, G_FILE_TEST_IS_REGULAR)) {
+			g_message("Skip %s, medium is gone", source->path);
+			continue;
+		}
+
+		g_message("Install bundle %s (%.1f MB/s)",
+		          source->path, source->throughput / 1e6);
+		mark_attached(context, "install");
+
+		/* either the caller or the removal of the medium stops the call */
+		install = g_cancellable_new();
+		medium_handler = g_cancellable_connect(source->cancellable,
+		                                       G_CALLBACK(forward_cancel),
+		                                       install, NULL);
+		if (cancellable)
+			caller_handler = g_cancellable_connect(cancellable,
+			                                       G_CALLBACK(forward_cancel),
+			                                       install, NULL);
+		res = rauc_installer_call_install_sync(context->installer,
+		                                       source->path,
+		                                       install,
+		                                       error);
+		g_cancellable_disconnect(source->cancellable, medium_handler);
+		if (cancellable)
+			g_cancellable_disconnect(cancellable, caller_handler);
+		return res;
+	}
+
+	g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+	            "No copy of %s available", disk_updater_bundle_get_path(bundle));
+	return FALSE;
+}
+
+/**
+ * @brief Thread function of an installation requested on dbus
+ *
+ * @param[in] GTask instance
+ * @param[in] bundle
+ * @param[in] MainContext struct
+ * @param[in] cancellable of the task
+ */
+static void
+install_thread_func(GTask *task,
+                    gpointer source_object,
+                    gpointer task_data,
+                    GCancellable *cancellable)
+{
+	GError *error = NULL;
+
+	if (install_bundle(task_data, source_object, cancellable, &error))
+		g_task_return_boolean(task, TRUE);
+	else
+		g_task_return_error(task, error);
+}
+
+/**
+ * @brief Completes the dbus method invocation of an installation
+ *
+ * @param[in] bundle
+ * @param[in] GTask instance
+ * @param[in] dbus method invocation
+ */
+static void
+on_install_done(GObject *source_object,
+                GAsyncResult *result,
+                gpointer user_data)
+{
+	GDBusMethodInvocation *invocation = user_data;
+	GError *error = NULL;
+
+	if (!g_task_propagate_boolean(G_TASK(result), &error)) {
+		g_warning("Failed %s\n", error->message);
+		g_dbus_method_invocation_take_error(invocation, error);
+	} else {
+		g_dbus_method_invocation_return_value(invocation, NULL);
+	}
+}
+
+/**
+ * @brief Callback of dbus interface for installing a bundle 
+ *
+ * The installation runs in a thread, so the main loop keeps serving dbus
+ * and signals meanwhile.
+ *
+ * @param[in] bundle 
+ * @param[in] dbus method invocation
+ * @param[in] MainContext struct
+ */
+static gboolean
+on_dbus_install (Bundle *interface,
+                 GDBusMethodInvocation *invocation,
+                 gpointer user_data)
+{
+	g_autoptr(GTask) task = NULL;
+
+	task = g_task_new(interface, NULL, on_install_done, invocation);
+	g_task_set_task_data(task, user_data, NULL);
+	g_task_run_in_thread(task, install_thread_func);
+	return TRUE;
+}
+
+/**
+ * @brief Checks whether an errno value indicates failing media
+ *
+ * Such errors are usually reported after the SCSI error handling gave up
+ * retrying, so every further access of the device is likely to block again.
+ *
+ * @param[in] errno value
+ * @return TRUE for media errors
+ */
+static gboolean
+is_media_errno(gint errsv)
+{
+	switch (errsv) {
+	case EIO:
+	case ETIMEDOUT:
+	case ENXIO:
+	case ENODEV:
+	case ENOMEDIUM:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * @brief Checks whether an error was caused by failing media
+ *
+ * Rauc reports read errors as text only, so the message is matched against
+ * the strerror() of the media errnos, like the messages of local reads.
+ *
+ * @param[in] error of a read or a rauc call
+ * @return TRUE for media errors
+ */
+static gboolean
+is_media_error(const GError *error)
+{
+	return strstr(error->message, g_strerror(EIO)) != NULL ||
+	       strstr(error->message, g_strerror(ETIMEDOUT)) != NULL;
+}
+
+/**
+ * @brief Checks whether a failed rauc call was caused by failing media
+ *
+ * Rauc handles one call at a time, so a call timing out is usually queued
+ * behind the verification of another device, and the D-Bus default of 25
+ * seconds is shorter than the verification of a large plain bundle. A
+ * timeout therefore only counts as media error if `[verification] timeout`
+ * is set, which then bounds a read stuck in the device.
+ *
+ * @param[in] Scan struct
+ * @param[in] error of a rauc call
+ * @return TRUE for media errors
+ */
+static gboolean
+is_rauc_media_error(Scan *scan, const GError *error)
+{
+	if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT))
+		return scan->config->verify_timeout != 0;
+
+	return is_media_error(error);
+}
+
+/**
+ * @brief Publishes the list of failing devices on dbus
+ *
+ * Call with the context lock held.
+ *
+ * @param[in] MainContext struct
+ */
+static void
+update_failing_disks(MainContext *context)
+{
+	g_autofree const gchar **ids = NULL;
+
+	ids = (const gchar **)g_hash_table_get_keys_as_array(context->failing_disks,
+	                                                     NULL);
+	disk_updater_set_failing_devices(context->disk_updater, ids);
+}
+
+/**
+ * @brief Counts a media error of the scanned device
+ *
+ * Once the `io-error-threshold` is reached, the scan is cancelled and the
+ * device is marked as failing. Other errors are ignored.
+ *
+ * @param[in] Scan struct
+ * @param[in] path of the failed access
+ * @param[in] errno value
+ */
+static void
+scan_io_error(Scan *scan, const gchar *path, gint errsv)
+{
+	MainContext *context = scan->context;
+	guint threshold = scan->config->io_error_threshold;
+
+	if (!is_media_errno(errsv))
+		return;
+
+	scan->io_errors++;
+	g_warning("I/O error %u at %s: %s", scan->io_errors, path, g_strerror(errsv));
+
+	if (threshold == 0 || scan->io_errors < threshold || scan->failing)
+		return;
+
+	g_warning("Device %s is failing, abort scan", scan->disk_id);
+	scan->failing = TRUE;
+	g_cancellable_cancel(scan->cancellable);
+
+	g_mutex_lock(&context->lock);
+	g_hash_table_add(context->failing_disks, g_strdup(scan->disk_id));
+	update_failing_disks(context);
+	g_mutex_unlock(&context->lock);
+}
+
+/**
+ * @brief Updates the measured throughput of the scanned medium
+ *
+ * Rauc reads the whole payload of plain bundles for the verification, so
+ * the duration of such a rauc call measures the read speed of the medium.
+ * Only plain bundles are sampled, rauc does not read the payload of the
+ * other formats. Short samples are ignored, they are dominated by latency.
+ *
+ * @param[in] Scan struct
+ * @param[in] bytes read
+ * @param[in] duration of the read in microseconds
+ */
+static void
+measure_throughput(Scan *scan, guint64 size, gint64 duration)
+{
+	gdouble rate;
+
+	if (size < 8 * 1024 * 1024 || duration < G_USEC_PER_SEC / 5)
+		return;
+
+	rate = (gdouble)size * G_USEC_PER_SEC / duration;
+	g_mutex_lock(&scan->context->lock);
+	if (scan->medium->measured > 0)
+		scan->medium->measured = (scan->medium->measured + rate) / 2;
+	else
+		scan->medium->measured = rate;
+	g_mutex_unlock(&scan->context->lock);
+}
+
+/**
+ * @brief Checks the compatible string of a bundle
+ *
+ * @param[in] Scan struct
+ * @param[in] path of the bundle
+ * @param[in] compatible string of the bundle
+ * @return TRUE if the bundle is accepted
+ */
+static gboolean
+is_compatible(Scan *scan, const gchar *path, const gchar *compatible)
+{
+	if (scan->config->check_compatible &&
+	    g_strcmp0(scan->context->compatible, compatible)) {
+		g_message("Ignore %s with unknown compatible %s",
+		          path, compatible);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Creates the dbus interface of a found bundle
+ *
+ * @param[in] Scan struct
+ * @param[in] path of the bundle
+ * @param[in] version of the bundle
+ * @param[in] fingerprint or NULL if unknown
+ * @param[in] size of the bundle
+ * @return bundle dbus interface
+ */
+static Bundle *
+new_bundle(Scan *scan,
+           const gchar *path,
+           const gchar *version,
+           const gchar *fingerprint,
+           guint64 size)
+{
+	g_autofree gchar *path_checksum = NULL;
+	gchar *interface_path;
+	Bundle *bundle;
+
+	g_message("%10s %s (%s)", "found", path, version);
+
+	bundle = disk_updater_bundle_skeleton_new();
+	disk_updater_bundle_set_version(bundle, version);
+	disk_updater_bundle_set_path(bundle, path);
+	disk_updater_bundle_set_fingerprint(bundle, fingerprint ? fingerprint : "");
+	disk_updater_bundle_set_size(bundle, size);
+	g_signal_connect (bundle,
+	                  "handle-install",
+	                  G_CALLBACK (on_dbus_install),
+	                  scan->context);
+
+	/* copies of a bundle share the object path, see publish_bundle() */
+	if (fingerprint == NULL)
+		fingerprint = path_checksum =
+			g_compute_checksum_for_string(G_CHECKSUM_SHA256, path, -1);
+	interface_path = g_strdup_printf("%s/%s",
+	                                 scan->config->bundle_object_path,
+	                                 fingerprint);
+	g_object_set_data_full(G_OBJECT(bundle), "object-path",
+	                       interface_path, g_free);
+	return bundle;
+}
+
+/**
+ * @brief Validates if a file is a rauc bundle
+ *
+ * If the file is a bundle, a dbus interface for this bundle is published.
+ *
+ * @param[in] Scan struct
+ * @param[in] Path to the file
+ * @param[in] TRUE if the file is read from the scanned medium
+ * @return NULL or bundle dbus interface
+ */
+static Bundle *
+check_rauc_bundle(Scan *scan,
+                  const gchar *path,
+                  gboolean on_medium)
+{
+	MainContext *context = scan->context;
+	GError *error = NULL;
+	gchar *compatible = NULL;
+	gchar *version = NULL;
+	gchar *fingerprint = NULL;
+	gchar *format = NULL;
+	g_autoptr(GBytes) signature = NULL;
+	guint64 size = 0;
+	gint64 started, duration;
+	Bundle *bundle = NULL;
+	gboolean res;
+
+	/* reject corrupted copies of verity bundles before the slow rauc call */
+	if (scan->config->verity_prevalidate &&
+	    !verity_prevalidate(path, scan->config->verity_threads,
+	                        scan->cancellable, &error)) {
+		if (!g_error_matches(error, VERITY_ERROR, VERITY_ERROR_UNSUPPORTED)) {
+			g_warning("Reject %s: %s", path, error->message);
+			if (is_media_error(error))
+				scan_io_error(scan, path, EIO);
+			g_clear_error(&error);
+			goto out;
+		}
+		g_clear_error(&error);
+	}
+	
+	/* query version and compatible string from bundle, rauc handles one
+	 * call at a time, so waiting here keeps the wait out of the duration */
+	g_mutex_lock(&context->info_lock);
+	started = g_get_monotonic_time();
+	res = rauc_installer_call_info_sync(context->installer,
+	                                    path,
+	                                    &compatible,
+	                                    &version,
+	                                    scan->cancellable,
+	                                    &error);
+	duration = g_get_monotonic_time() - started;
+	g_mutex_unlock(&context->info_lock);
+	if (!res) {
+		g_warning("Failed to verify %s", path);
+		if (is_rauc_media_error(scan, error))
+			scan_io_error(scan, path, EIO);
+		g_clear_error(&error);
+		goto out;
+	}
+	
+	/* filter bundles with matching compatible string */
+	if (!is_compatible(scan, path, compatible))
+		goto out;
+
+	/* identify copies of the same bundle on other media */
+	if (!bundle_file_read_signature(path, &size, &signature, &error)) {
+		g_warning("No fingerprint of %s: %s", path, error->message);
+		g_clear_error(&error);
+	} else {
+		fingerprint = g_compute_checksum_for_bytes(G_CHECKSUM_SHA256,
+		                                           signature);
+		format = bundle_file_format(signature);
+		if (on_medium && g_strcmp0(format, "plain") == 0)
+			measure_throughput(scan, size, duration);
+	}
+
+	/* set up new dbus interface for bundle */
+	bundle = new_bundle(scan, path, version, fingerprint, size);
+ out:	
+	g_free(compatible);
+	g_free(version);
+	g_free(fingerprint);
+	g_free(format);
+	return bundle;
+}
+
+/**
+ * @brief Checks whether the walk budget of a device is used up
+ *
+ * @param[in] Scan struct
+ * @return TRUE if the walk has to stop
+ */
+static gboolean
+walk_exhausted(Scan *scan)
+{
+	Config *config = scan->config;
+
+	return config->scan_max_entries && scan->entries >= config->scan_max_entries;
+}
+
+/**
+ * @brief Checks whether the bundle budget of a device is used up
+ *
+ * @param[in] Scan struct
+ * @return TRUE if no further bundles are verified
+ */
+static gboolean
+verify_exhausted(Scan *scan)
+{
+	Config *config = scan->config;
+
+	return config->max_bundles && scan->bundles >= config->max_bundles;
+}
+
+/**
+ * @brief Checks whether a file is an archive possibly containing bundles
+ *
+ * @param[in] Scan struct
+ * @param[in] path to the file
+ * @return TRUE if the file has an archive suffix
+ */
+static gboolean
+is_archive(Scan *scan, const gchar *path)
+{
+	gchar **suffix;
+
+	if (!scan->config->archive_enabled)
+		return FALSE;
+
+	for (suffix = scan->config->archive_suffixes; *suffix; suffix++) {
+		if (**suffix && g_str_has_suffix(path, *suffix))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * @brief Search for rauc bundle files at a path
+ *
+ * The directory is read with readdir() instead of GDir to get the errno of
+ * failed reads. The entry type is taken from `d_type` if the filesystem
+ * provides it, which saves a stat() per entry. The files are only collected
+ * here, verification is a separate stage.
+ *
+ * @param[in] Scan struct
+ * @param[in] path to the search path
+ * @param[in] directory level below the mount point
+ * @return List of file paths with the bundle or an archive suffix
+ */
+static GSList *
+find_rauc_bundles(Scan *scan,
+                  const gchar *path,
+                  guint depth)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct stat st;
+	gchar *file;
+	guchar type;
+	gint errsv;
+	GSList *files = NULL;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		errsv = errno;
+		g_warning("Could not open %s: %s", path, g_strerror(errsv));
+		scan_io_error(scan, path, errsv);
+		return NULL;
+	}
+
+	while (!g_cancellable_is_cancelled(scan->cancellable) &&
+	       !walk_exhausted(scan)) {
+		errno = 0;
+		entry = readdir(dir);
+		if (entry == NULL) {
+			if (errno != 0)
+				scan_io_error(scan, path, errno);
+			break;
+		}
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+
+		scan->entries++;
+		file = g_strdup_printf("%s/%s",path, entry->d_name);
+		type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			if (lstat(file, &st) != 0) {
+				scan_io_error(scan, file, errno);
+				g_free(file);
+				continue;
+			}
+			type = S_ISLNK(st.st_mode) ? DT_LNK :
+			       S_ISDIR(st.st_mode) ? DT_DIR :
+			       S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		/* do not follow symlinks */
+		if (type == DT_DIR) {
+			/* recursive call */
+			if (depth < scan->config->scan_max_depth)
+				files = g_slist_concat(files,
+				                       find_rauc_bundles(scan, file, depth + 1));
+		} else if (type == DT_REG &&
+		           (g_str_has_suffix(file, scan->config->bundle_suffix) ||
+		            is_archive(scan, file))) {
+			files = g_slist_prepend(files, file);
+			continue;
+		}
+		g_free(file);
+	}
+	closedir(dir);
+	return files;
+}
+
+/**
+ * @brief Checks whether a path is an entry of the daemon
+ *
+ * The staging directory may be shared with other programs, e.g. /var/tmp.
+ * Only entries of the expected type owned by the daemon are touched,
+ * symlinks are never followed.
+ *
+ * @param[in] path
+ * @param[in] file type (S_IFREG or S_IFDIR)
+ * @return TRUE if the entry is owned by the daemon
+ */
+static gboolean
+is_own_entry(const gchar *path, mode_t type)
+{
+	struct stat st;
+
+	return lstat(path, &st) == 0 && (st.st_mode & S_IFMT) == type &&
+	       st.st_uid == geteuid();
+}
+
+/**
+ * @brief Removes the files left in the staging directory
+ *
+ * Extracted files are removed with their bundles. A daemon killed or
+ * restarted leaves them behind, so they are removed at startup, before any
+ * bundle is staged. Only files named like archive_extract_member() creates
+ * them are removed.
+ *
+ * @param[in] staging directory holding one directory per device
+ * @param[in] bundle file suffix
+ */
+static void
+clear_staging_dir(const gchar *staging_dir, const gchar *suffix)
+{
+	g_autoptr(GDir) dir = g_dir_open(staging_dir, 0, NULL);
+	/* mkstemp name, escaped to avoid the trigraph ??- */
+	g_autofree gchar *pattern = g_strdup_printf("\?\?\?\?\?\?-*%s", suffix);
+	const gchar *disk, *name;
+	gchar *disk_dir, *file;
+	GDir *files;
+
+	if (dir == NULL)
+		return;
+
+	while ((disk = g_dir_read_name(dir))) {
+		disk_dir = g_build_filename(staging_dir, disk, NULL);
+		files = NULL;
+		if (is_own_entry(disk_dir, S_IFDIR))
+			files = g_dir_open(disk_dir, 0, NULL);
+		while (files && (name = g_dir_read_name(files))) {
+			if (!g_pattern_match_simple(pattern, name))
+				continue;
+			file = g_build_filename(disk_dir, name, NULL);
+			if (is_own_entry(file, S_IFREG) && unlink(file) != 0)
+				g_warning("Could not remove %s: %s", file, g_strerror(errno));
+			g_free(file);
+		}
+		if (files) {
+			g_dir_close(files);
+			g_rmdir(disk_dir); /* only if empty */
+		}
+		g_free(disk_dir);
+	}
+}
+
+/**
+ * @brief Checks whether a member can be extracted into the staging directory
+ *
+ * @param[in] Scan struct
+ * @param[in] staging directory of the device
+ * @param[in] ArchiveMember
+ * @return TRUE if the staging budget or the free space is exceeded
+ */
+static gboolean
+staging_exhausted(Scan *scan, const gchar *dir, const ArchiveMember *member)
+{
+	guint64 max = (guint64)scan->config->max_staging_size * 1024 * 1024;
+	struct statvfs st;
+
+	if (max && scan->staged_size + member->size > max) {
+		g_warning("Staging budget exhausted, skip %s", member->name);
+		return TRUE;
+	}
+	if (statvfs(dir, &st) == 0 &&
+	    (guint64)st.f_bavail * st.f_frsize < member->size) {
+		g_warning("No space in %s for %s", dir, member->name);
+		return TRUE;
+	}
+	return FALSE;
+}
 
-/* Commandline options */
-static GOptionEntry entries[] =
-	{
-	 { "script", 's', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &script_file,
-	   "Script file", NULL },
-	 { "version", 'v', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_version,
-	   "Version information", NULL },
-	 { NULL }
-	};
+/**
+ * @brief Compare function for sorting archive members by their offset
+ */
+static gint
+compare_members(gconstpointer a, gconstpointer b)
+{
+	const ArchiveMember *ma = *(const ArchiveMember **)a;
+	const ArchiveMember *mb = *(const ArchiveMember **)b;
+
+	return (ma->offset > mb->offset) - (ma->offset < mb->offset);
+}
 
 /**
- * @brief Callback of dbus interface for installing a bundle 
+ * @brief Checks the compatible of an archived bundle before extracting it
  *
- * @param[in] bundle 
- * @param[in] dbus method invocation
- * @param[in] MainContext struct
+ * Verity bundles embed the manifest in their signature as plain text. The
+ * signature is not verified here, so its compatible is only used to skip
+ * members built for other systems without copying them; accepted members
+ * are extracted and verified by rauc like any other bundle. Plain bundles
+ * keep the manifest in the image and crypt bundles encrypt it, they are
+ * always extracted.
+ *
+ * @param[in] Scan struct
+ * @param[in] path to the archive
+ * @param[in] ArchiveMember
+ * @return FALSE if the member is a bundle for another system
  */
-static void
-on_dbus_install (Bundle *interface,
-                 GDBusMethodInvocation *invocation,
-                 gpointer user_data)
+static gboolean
+is_compatible_member(Scan *scan,
+                     const gchar *path,
+                     const ArchiveMember *member)
 {
-	MainContext *context = (MainContext*) user_data;
-	const gchar *path = disk_updater_bundle_get_path(interface);
-	GError *error = NULL;
-	
-	g_message("Install bundle %s", path);
-	if (! rauc_installer_call_install_sync(context->installer, path, NULL, &error)) {
-		g_warning("Failed %s\n", error->message);
-		g_dbus_method_invocation_take_error(invocation, error);
-	} else {
-		g_dbus_method_invocation_return_value(invocation, NULL);
-	}
+	g_autoptr(GBytes) signature = NULL;
+	g_autofree gchar *compatible = NULL;
+	g_autofree gchar *bundle_path = NULL;
+
+	if (!scan->config->check_compatible)
+		return TRUE;
+
+	/* errors are reported by the extraction of the member */
+	if (!bundle_file_read_signature_at(path, member->offset, member->size,
+	                                   &signature, NULL))
+		return TRUE;
+
+	compatible = bundle_file_manifest_value(signature, "compatible");
+	if (compatible == NULL)
+		return TRUE;
+
+	bundle_path = g_build_filename(path, member->name, NULL);
+	return is_compatible(scan, bundle_path, compatible);
 }
 
 /**
- * @brief Validates if a file is a rauc bundle
+ * @brief Verifies the bundles stored inside an archive
  *
- * If the file is a bundle, a dbus interface for this bundle is published.
+ * The members are indexed from the archive headers without reading their
+ * data. Since rauc needs a file, each member is streamed once into the
+ * staging directory of the device and verified from there; members are
+ * extracted in the order of their offset, so the archive is read
+ * sequentially. Members of other systems are skipped before the copy, see
+ * is_compatible_member(). Extracted files are removed when
+ * they are no bundles, otherwise when the bundle is released.
  *
- * @param[in] MainContext struct
- * @param[in] cancellable for stopping the validation
- * @param[in] Path to the file
- * @return NULL or bundle dbus interface
+ * @param[in] Scan struct
+ * @param[in] path to the archive
+ * @return List of published bundles
  */
-static Bundle *
-check_rauc_bundle(MainContext *context,
-                  GCancellable *cancellable,
-                  const gchar *path)
+static GSList *
+check_archive(Scan *scan, const gchar *path)
 {
+	g_autoptr(GPtrArray) members = NULL;
+	g_autofree gchar *dir = NULL;
+	gchar *staged;
 	GError *error = NULL;
-	gchar *compatible = NULL;
-	gchar *version = NULL;
-	gchar *interface_path;
-	Bundle *bundle = NULL;
-		
-	/* filter for suffix .raucb */
-	if(! g_str_has_suffix(path, ".raucb"))
-		goto out;
-	
-	/* query version and compatible string from bundle */
-	if (!rauc_installer_call_info_sync(context->installer,
-	                                   path,
-	                                   &compatible,
-	                                   &version,
-	                                   cancellable,
-	                                   &error)) {
-		g_warning("Failed to verify %s", path);
+	GSList *bundles = NULL;
+	ArchiveMember *member;
+	Bundle *bundle;
+	gint64 started;
+	guint i;
+
+	members = archive_list_members(path, scan->config->bundle_suffix, &error);
+	if (members == NULL) {
+		g_warning("Could not read archive %s: %s", path, error->message);
+		if (is_media_error(error))
+			scan_io_error(scan, path, EIO);
 		g_clear_error(&error);
-		goto out;
+		return NULL;
 	}
-	
-	/* filter bundles with matching compatible string */
-	if (g_strcmp0(context->compatible, compatible)) {
-		g_message("Ignore %s with unknown compatible %s",
-		          path, compatible);
-		goto out;
+	if (members->len == 0)
+		return NULL;
+
+	dir = g_build_filename(scan->config->staging_dir, scan->disk_id, NULL);
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		g_warning("Could not create %s: %s", dir, g_strerror(errno));
+		return NULL;
 	}
 
-	g_message("%10s %s (%s)", "found", path, version);
+	g_ptr_array_sort(members, compare_members);
+	for (i = 0; i < members->len &&
+	       !g_cancellable_is_cancelled(scan->cancellable) &&
+	       !verify_exhausted(scan); i++) {
+		member = g_ptr_array_index(members, i);
+		if (!is_compatible_member(scan, path, member) ||
+		    staging_exhausted(scan, dir, member))
+			continue;
 
-	/* set up new dbus interface for bundle */
-	bundle = disk_updater_bundle_skeleton_new();
-	disk_updater_bundle_set_version(bundle, version);
-	disk_updater_bundle_set_path(bundle, path);
-	g_signal_connect (bundle,
-	                  "handle-install",
-	                  G_CALLBACK (on_dbus_install),
-	                  context);
-	
-	/* publish dbus interface for found bundle */	
-	interface_path = g_strdup_printf("/de/helbling/DiskUpdater/bundles/%d",
-	                                 ++(context->bundle_dbus_count));
-	g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(bundle),
-	                                 context->dbus_connection,
-	                                 interface_path,
-	                                 NULL);
- out:	
-	g_free(compatible);
-	g_free(version);
-	g_free(interface_path);
-	return bundle;
+		started = g_get_monotonic_time();
+		staged = archive_extract_member(path, member, dir,
+		                                scan->cancellable, &error);
+		if (staged == NULL) {
+			g_warning("Could not extract %s from %s: %s",
+			          member->name, path, error->message);
+			if (is_media_error(error))
+				scan_io_error(scan, path, EIO);
+			g_clear_error(&error);
+			continue;
+		}
+		scan->staged_size += member->size;
+		measure_throughput(scan, member->size, g_get_monotonic_time() - started);
+		g_message("%10s %s from %s", "extracted", member->name, path);
+
+		bundle = check_rauc_bundle(scan, staged, FALSE);
+		if (bundle == NULL) {
+			unlink(staged);
+			g_free(staged);
+			continue;
+		}
+		g_object_set_data_full(G_OBJECT(bundle), "staged-file",
+		                       staged, unlink_staged_file);
+		scan->bundles++;
+		bundles = g_slist_prepend(bundles, bundle);
+	}
+	g_rmdir(dir); /* only if nothing was staged */
+	return bundles;
 }
 
 /**
- * @brief Search for rauc bundles at a path
+ * @brief Verifies the found bundle files of a device
  *
- * @param[in] MainContext struct
- * @param[in] cancellable for stopping the search
- * @param[in] path to the search path
+ * @param[in] Scan struct
+ * @param[in] List of file paths
+ * @return List of published bundles
  */
 static GSList *
-find_rauc_bundles(MainContext *context,
-                  GCancellable *cancellable,
-                  const gchar *path)
+verify_rauc_bundles(Scan *scan, GSList *files)
 {
-	GDir *dir;
-	GError *error = NULL;
-	gchar *file;
-	const gchar *name;
 	GSList *bundles = NULL;
 	Bundle *bundle;
 
-	dir = g_dir_open(path, 0, &error);
-	while (!g_cancellable_is_cancelled(cancellable) &&
-	       dir != NULL && (name = g_dir_read_name(dir))) {
-		
-		file = g_strdup_printf("%s/%s",path, name);
-		/* do not follow symlinks */
-		if (g_file_test (file, G_FILE_TEST_IS_SYMLINK)) {
+	for (; files && !g_cancellable_is_cancelled(scan->cancellable) &&
+	       !verify_exhausted(scan); files = g_slist_next(files)) {
+		if (is_archive(scan, files->data)) {
+			bundles = g_slist_concat(check_archive(scan, files->data), bundles);
 			continue;
-		} else if (g_file_test (file, G_FILE_TEST_IS_DIR)) {
-			/* recursive call */
-			bundles = g_slist_concat(bundles,find_rauc_bundles(context,
-			                                                   cancellable,
-			                                                   file));
-		} else if (g_file_test (file, G_FILE_TEST_IS_REGULAR)) {
-			bundle = check_rauc_bundle(context, cancellable, file);
-			if(bundle) {
-				bundles = g_slist_prepend(bundles, bundle);
-			}
 		}
-		g_free(file);
+		bundle = check_rauc_bundle(scan, files->data, TRUE);
+		if(bundle) {
+			scan->bundles++;
+			bundles = g_slist_prepend(bundles, bundle);
+		}
 	}
-	g_dir_close(dir);
 	return bundles;
 }
 
@@ -205,7 +1257,7 @@ find_rauc_bundles(MainContext *context,
  *
  * @param[in] MainContext struct
  * @param[in] cancellable for stopping the search
- * @param[in] List of bundles for the installation
+ * @param[in] List of bundles for the installation, highest version first
  */
 static void
 run_hook_install(MainContext *context,
@@ -214,6 +1266,8 @@ run_hook_install(MainContext *context,
 {
 	g_autoptr(GSubprocessLauncher) launcher = NULL;
 	g_autoptr(GSubprocess) subprocess = NULL;
+	g_autoptr(Config) config = get_config(context);
+	const gchar *script = script_file ? script_file : config->script_file;
 	GError *error = NULL;
 	gboolean res = FALSE;
 	gchar *str;
@@ -222,13 +1276,13 @@ run_hook_install(MainContext *context,
 	gint index;
 	GSList *bundles = bundles_head;
 	
-	if (script_file == NULL)
+	if (script == NULL)
 		goto out;
 
 	if(bundles == NULL)
 		goto out;
 
-	g_debug("Start hook script %s", script_file);
+	g_debug("Start hook script %s", script);
 	launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
 	
 	while(bundles) {
@@ -256,12 +1310,15 @@ run_hook_install(MainContext *context,
 	str = g_strdup_printf("%d",bundle_ctr);
 	g_subprocess_launcher_setenv(launcher, "BUNDLES", str, TRUE);
 	g_clear_pointer(&str, g_free);
+
+	/* bundles are ordered by version, the first one is the best */
+	g_subprocess_launcher_setenv(launcher, "BUNDLE_BEST", "1", TRUE);
 	
-	subprocess = g_subprocess_launcher_spawn(launcher, &error, script_file,
+	subprocess = g_subprocess_launcher_spawn(launcher, &error, script,
 	                                         "install", NULL);
 	
 	if (subprocess == NULL) {
-		g_warning("Failed to run script %s", script_file);
+		g_warning("Failed to run script %s", script);
 		g_clear_error(&error);
 		goto out;
 	}
@@ -284,11 +1341,7 @@ run_hook_install(MainContext *context,
 		goto out;
 	}
 
-	g_message("Install bundle %s", disk_updater_bundle_get_path(bundle));
-	if (! rauc_installer_call_install_sync(context->installer,
-	                                       disk_updater_bundle_get_path(bundle),
-	                                       cancellable,
-	                                       &error)) {
+	if (! install_bundle(context, bundle, cancellable, &error)) {
 		g_warning("Failed %s\n", error->message);
 		g_clear_error(&error);
 	}
@@ -300,15 +1353,131 @@ run_hook_install(MainContext *context,
 /**
  * @brief Free a bundle interface
  *
+ * The bundle has to be unpublished before.
+ *
  * @param[in] bundle dbus interface
  */
 static void
 free_bundle(gpointer data)
 {
-	g_dbus_interface_skeleton_unexport((GDBusInterfaceSkeleton *)data);
 	g_object_unref(data);
 }
 
+/**
+ * @brief Returns the object path of a bundle
+ *
+ * The path is derived from the fingerprint, so all copies of a bundle and
+ * the same bundle after a re-plug have the same path.
+ *
+ * @param[in] bundle dbus interface
+ * @return object path
+ */
+static const gchar *
+bundle_object_path(Bundle *bundle)
+{
+	return g_object_get_data(G_OBJECT(bundle), "object-path");
+}
+
+/**
+ * @brief Exports a bundle at its object path
+ *
+ * @param[in] MainContext struct
+ * @param[in] bundle dbus interface
+ */
+static void
+export_bundle(MainContext *context, Bundle *bundle)
+{
+	GError *error = NULL;
+
+	if (!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(bundle),
+	                                      context->dbus_connection,
+	                                      bundle_object_path(bundle),
+	                                      &error)) {
+		g_warning("Failed to export %s: %s",
+		          bundle_object_path(bundle), error->message);
+		g_clear_error(&error);
+	}
+}
+
+/**
+ * @brief Increments the generation of the exported bundle objects
+ *
+ * Call with the context lock held.
+ *
+ * @param[in] MainContext struct
+ */
+static void
+bump_generation(MainContext *context)
+{
+	disk_updater_set_generation(context->disk_updater, ++(context->generation));
+}
+
+/**
+ * @brief Publishes a bundle on dbus
+ *
+ * Only one copy of a bundle is exported, further copies are kept in the
+ * list of its object path and take over when the exported copy is removed.
+ * Call with the context lock held.
+ *
+ * @param[in] MainContext struct
+ * @param[in] bundle dbus interface
+ */
+static void
+publish_bundle(MainContext *context, Bundle *bundle)
+{
+	const gchar *path = bundle_object_path(bundle);
+	GSList *copies = NULL;
+	gpointer key = NULL;
+
+	if (!g_hash_table_steal_extended(context->exported, path,
+	                                 &key, (gpointer *)&copies))
+		key = g_strdup(path);
+	if (copies == NULL) {
+		export_bundle(context, bundle);
+		bump_generation(context);
+	}
+	g_hash_table_insert(context->exported, key,
+	                    g_slist_append(copies, g_object_ref(bundle)));
+}
+
+/**
+ * @brief Removes a bundle from dbus
+ *
+ * If the bundle was the exported copy, the next copy is exported at the
+ * same object path. Call with the context lock held.
+ *
+ * @param[in] MainContext struct
+ * @param[in] bundle dbus interface
+ */
+static void
+unpublish_bundle(MainContext *context, Bundle *bundle)
+{
+	const gchar *path = bundle_object_path(bundle);
+	GSList *copies = NULL;
+	gpointer key = NULL;
+
+	if (!g_hash_table_steal_extended(context->exported, path,
+	                                 &key, (gpointer *)&copies))
+		return;
+
+	if (copies->data == bundle) {
+		g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(bundle));
+		copies = g_slist_delete_link(copies, copies);
+		if (copies)
+			export_bundle(context, copies->data);
+		bump_generation(context);
+		g_object_unref(bundle);
+	} else if (g_slist_find(copies, bundle)) {
+		copies = g_slist_remove(copies, bundle);
+		g_object_unref(bundle);
+	}
+
+	if (copies)
+		g_hash_table_insert(context->exported, key, copies);
+	else
+		g_free(key);
+}
+
 /**
  * @brief foreach-callback for freeing a list of bundles
  *
@@ -320,16 +1489,182 @@ bundles_destroyed(gpointer data)
 	g_slist_free_full((GSList *)data, free_bundle);
 }
 
+/**
+ * @brief Publishes the bundle with the highest version on dbus
+ *
+ * Call with the context lock held after changing the candidates. The
+ * property is only written if the best bundle changed.
+ *
+ * @param[in] MainContext struct
+ */
+static void
+update_best_bundle(MainContext *context)
+{
+	Bundle *best = candidate_store_get_best(context->candidates);
+	const gchar *path = NULL;
+
+	if (best == context->best_bundle)
+		return;
+
+	context->best_bundle = best;
+	if (best)
+		path = bundle_object_path(best);
+	disk_updater_set_best_bundle(context->disk_updater, path ? path : "/");
+	if (best)
+		g_message("Best bundle %s (%s)",
+		          disk_updater_bundle_get_path(best),
+		          disk_updater_bundle_get_version(best));
+}
+
+static void schedule_decision(MainContext *context);
+
+/**
+ * @brief Thread running the install hook with the bundles of all devices
+ *
+ * @param[in] MainContext struct
+ * @return NULL
+ */
+static gpointer
+decision_thread_func(gpointer user_data)
+{
+	MainContext *context = (MainContext*) user_data;
+	GSList *bundles;
+
+	g_mutex_lock(&context->lock);
+	bundles = candidate_store_list(context->candidates);
+	g_mutex_unlock(&context->lock);
+
+	g_debug("Decide with %u bundles", g_slist_length(bundles));
+	mark_attached(context, "decision");
+	run_hook_install(context, context->decision_cancellable, bundles);
+	g_slist_free_full(bundles, g_object_unref);
+
+	g_mutex_lock(&context->lock);
+	g_clear_object(&context->decision_cancellable);
+	if (context->decision_pending) {
+		/* devices were attached while deciding, decide again */
+		context->decision_pending = FALSE;
+		g_mutex_unlock(&context->lock);
+		schedule_decision(context);
+	} else {
+		g_mutex_unlock(&context->lock);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Debounce timer of the install decision
+ *
+ * The decision is taken once no device was added or attached for the
+ * `decision-delay` and no device is pending: settling, waiting for its
+ * link, mounting or being scanned. Otherwise the timer is armed again, a
+ * device removed before its scan must not suppress the decision.
+ *
+ * @param[in] MainContext struct
+ * @return G_SOURCE_REMOVE
+ */
+static gboolean
+on_decision_timeout(gpointer user_data)
+{
+	MainContext *context = (MainContext*) user_data;
+	guint id = g_source_get_id(g_main_current_source());
+	GThread *finished = NULL;
+	GThread *thread;
+	gboolean start = FALSE;
+
+	g_mutex_lock(&context->lock);
+	if (context->decision_timeout != id) {
+		/* rescheduled while this callback was dispatched */
+		goto out;
+	}
+	context->decision_timeout = 0;
+
+	if (context->scan_count > 0 ||
+	    udev_monitor_get_pending(context->monitor) > 0) {
+		context->decision_timeout =
+			g_timeout_add((guint)(context->config->decision_delay * 1000),
+			              on_decision_timeout,
+			              context);
+		goto out;
+	}
+
+	if (context->decision_cancellable != NULL) {
+		/* decision in progress */
+		context->decision_pending = TRUE;
+		goto out;
+	}
+
+	finished = context->decision_thread;
+	context->decision_thread = NULL;
+	context->decision_cancellable = g_cancellable_new();
+	start = TRUE;
+ out:
+	g_mutex_unlock(&context->lock);
+
+	/* the previous decision thread may still wait for the lock */
+	if (finished)
+		g_thread_join(finished);
+
+	if (start) {
+		thread = g_thread_new("decision", decision_thread_func, context);
+		g_mutex_lock(&context->lock);
+		context->decision_thread = thread;
+		g_mutex_unlock(&context->lock);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief (Re)starts the debounce timer of the install decision
+ *
+ * Can be called from any thread.
+ *
+ * @param[in] MainContext struct
+ */
+static void
+schedule_decision(MainContext *context)
+{
+	g_autoptr(Config) config = get_config(context);
+
+	g_mutex_lock(&context->lock);
+	if (context->decision_timeout)
+		g_source_remove(context->decision_timeout);
+	context->decision_timeout = g_timeout_add((guint)(config->decision_delay * 1000),
+	                                          on_decision_timeout,
+	                                          context);
+	g_mutex_unlock(&context->lock);
+}
+
+/**
+ * @brief Signal callback for a new disk
+ *
+ * Executed in the main loop. The disk is scanned only after it settled and
+ * got a slot of its link, the decision waits for it from now on.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] GUdevDevice instance
+ * @param[in] MainContext struct
+ */
+static void
+on_added(UdevMonitor *monitor,
+         GUdevDevice *device,
+         gpointer user_data)
+{
+	schedule_decision((MainContext*) user_data);
+}
+
 /**
  * @brief Signal callback for an plugged in device
  *
- * This function is executed in a separate thread of the UdevMonitor. If the
- * device is removed again, the cancellable is set.
+ * This function is executed in a thread pool of the UdevMonitor, attaches of
+ * several devices run concurrently. If the device is removed again, the
+ * cancellable is set; the detach is emitted after this function returned.
 
  * @param[in] UdevMonitor instance
  * @param[in] GUDevDevice struct of the block device
  * @param[in] Mountpoints of the partitions
  * @param[in] cancellable for stopping the operation
+ * @param[in] timestamps of the udev stages
  * @param[in] MainContext struct
  */
 static void
@@ -337,31 +1672,77 @@ on_attach(UdevMonitor *monitor,
          GUdevDevice *device,
          gpointer *mount_points,
          GCancellable *cancellable,
+         UdevTimes *times,
          gpointer user_data)
 {
 	GSList *mount_point = (GSList *)mount_points;
 	MainContext *context = (MainContext*) user_data;
+	g_autofree gchar *disk_id = udev_device_get_disk_id(device);
+	GSList *files = NULL;
 	GSList *bundles = NULL;
+	GSList *item;
+	Scan scan = { 0 };
 	
+	scan.context = context;
+	scan.config = get_config(context);
+	scan.disk_id = disk_id;
+	scan.cancellable = cancellable;
+	scan.medium = g_new0(Medium, 1);
+	scan.medium->expected = udev_device_get_expected_throughput(device);
+	scan.medium->cancellable = g_object_ref(cancellable);
+
+	g_mutex_lock(&context->lock);
+	g_hash_table_replace(context->media, g_strdup(disk_id), scan.medium);
+	g_hash_table_replace(context->timelines,
+	                     g_strdup(disk_id),
+	                     timeline_new(disk_id));
+	mark_stage_locked(context, disk_id, "uevent", times->uevent);
+	mark_stage_locked(context, disk_id, "settled", times->settled);
+	mark_stage_locked(context, disk_id, "mounted", times->mounted);
 	disk_updater_set_device_count(context->disk_updater, ++(context->device_count));
+	context->scan_count++;
 	disk_updater_set_status(context->disk_updater, "scanning");
+	g_mutex_unlock(&context->lock);
 
 	while(mount_point && !g_cancellable_is_cancelled(cancellable)) {
-		bundles = g_slist_concat(bundles,
-		                         find_rauc_bundles(context,
-		                                           cancellable,
-		                                           mount_point->data));
+		files = g_slist_concat(files,
+		                       find_rauc_bundles(&scan,
+		                                         mount_point->data,
+		                                         0));
 		mount_point = g_slist_next(mount_point);
 	}
+	if (walk_exhausted(&scan))
+		g_warning("Scan budget exhausted after %u entries", scan.entries);
+	mark_stage(context, disk_id, "walked", g_get_monotonic_time());
+
+	bundles = verify_rauc_bundles(&scan, files);
+	g_slist_free_full(files, g_free);
+	if (verify_exhausted(&scan))
+		g_warning("Bundle budget exhausted after %u bundles", scan.bundles);
+	mark_stage(context, disk_id, "verified", g_get_monotonic_time());
+	config_unref(scan.config);
+
+	if (scan.failing) {
+		/* bundles on failing media would fail again during installation */
+		bundles_destroyed(bundles);
+		bundles = NULL;
+		udev_monitor_unmount(monitor, mount_points);
+	}
+	g_mutex_lock(&context->lock);
 	g_hash_table_insert(context->bundles_by_disk,
-	                    NEW_DISK_ID(device),
+	                    g_strdup(disk_id),
 	                    bundles);
-	disk_updater_set_status(context->disk_updater, "idle");   
-	
-	/* start script install hook*/
-	if(!g_cancellable_is_cancelled(cancellable)) {
-		run_hook_install(context, cancellable, bundles);	
+	for (item = bundles; item; item = g_slist_next(item)) {
+		publish_bundle(context, item->data);
+		candidate_store_add(context->candidates, disk_id, item->data);
 	}
+	update_best_bundle(context);
+	if (--(context->scan_count) == 0)
+		disk_updater_set_status(context->disk_updater, "idle");
+	g_mutex_unlock(&context->lock);
+	
+	/* the install hook decides once for all attached devices */
+	schedule_decision(context);
 }
 
 
@@ -382,15 +1763,26 @@ on_detach(UdevMonitor *monitor,
 {
 	//	g_debug("%10s %s", "detached", DEVICE_ID(device));
 	MainContext *context = (MainContext*) user_data;
+	g_autofree gchar *disk_id = udev_device_get_disk_id(device);
+	GSList *item;
 
+	g_mutex_lock(&context->lock);
 	context->device_count--;
 	disk_updater_set_device_count(context->disk_updater, context->device_count);
-	if(context->device_count == 0) {
-		/* reset bundle counter used for generating bundle interfaces */
-		context->bundle_dbus_count = 0;
-	}
-		
-	g_hash_table_remove (context->bundles_by_disk, DISK_ID(device));
+
+	item = g_hash_table_lookup(context->bundles_by_disk, disk_id);
+	for (; item; item = g_slist_next(item))
+		unpublish_bundle(context, item->data);
+	candidate_store_remove_disk(context->candidates, disk_id);
+	update_best_bundle(context);
+	g_hash_table_remove(context->timelines, disk_id);
+	publish_timelines(context);
+	g_hash_table_remove(context->media, disk_id);
+	g_hash_table_remove (context->bundles_by_disk, disk_id);
+
+	if (g_hash_table_remove(context->failing_disks, disk_id))
+		update_failing_disks(context);
+	g_mutex_unlock(&context->lock);
 }
 
 /**
@@ -416,6 +1808,14 @@ on_bus_acquired(GDBusConnection *connection,
 	                                 "/de/helbling/DiskUpdater",
 	                                 NULL);
 	disk_updater_set_status(disk_updater, "idle");
+	disk_updater_set_best_bundle(disk_updater, "/");
+	g_mutex_lock(&context->lock);
+	publish_timelines(context);
+	g_mutex_unlock(&context->lock);
+	g_signal_connect (disk_updater,
+	                  "handle-reload",
+	                  G_CALLBACK (on_dbus_reload),
+	                  context);
 }
 
 /**
@@ -430,7 +1830,10 @@ on_name_acquired(GDBusConnection *connection,
                  const gchar *name,
                  gpointer user_data)
 {
+	MainContext *context = (MainContext*) user_data;
+
 	g_debug("Bus name %s aquired", name);
+	mark_stage(context, "startup", "name-acquired", g_get_monotonic_time());
 }
 
 /**
@@ -471,6 +1874,24 @@ on_sigterm(gpointer user_data)
 	return G_SOURCE_REMOVE;
 }
 
+/**
+ * @brief Callback for reloading the configuration by the SIGHUP signal
+ *
+ * @param[in] MainContext struct
+ */
+static gboolean
+on_sighup(gpointer user_data)
+{
+	MainContext *context = (MainContext*) user_data;
+	GError *error = NULL;
+
+	if (!reload_config(context, &error)) {
+		g_warning("Failed to reload configuration: %s", error->message);
+		g_clear_error(&error);
+	}
+	return G_SOURCE_CONTINUE;
+}
+
 
 int main(int argc, char **argv) {
 	
@@ -480,12 +1901,33 @@ int main(int argc, char **argv) {
 	GOptionContext *option_context;
 	guint owner_id;
 	MainContext *context;
+	Config *config = NULL;
+	GThread *thread;
 
 	context = g_slice_new0(MainContext);
+	g_mutex_init(&context->lock);
+	g_mutex_init(&context->info_lock);
+	context->timelines = g_hash_table_new_full(g_str_hash,
+	                                           g_str_equal,
+	                                           g_free,
+	                                           (GDestroyNotify)timeline_free);
+	context->media = g_hash_table_new_full(g_str_hash,
+	                                       g_str_equal,
+	                                       g_free,
+	                                       free_medium);
+	context->failing_disks = g_hash_table_new_full(g_str_hash,
+	                                               g_str_equal,
+	                                               g_free,
+	                                               NULL);
 	context->bundles_by_disk = g_hash_table_new_full(g_str_hash,
 	                                                 g_str_equal,
 	                                                 (GDestroyNotify)g_free,
 	                                                 bundles_destroyed);
+	context->exported = g_hash_table_new_full(g_str_hash,
+	                                          g_str_equal,
+	                                          g_free,
+	                                          bundles_destroyed);
+	context->candidates = candidate_store_new();
 	
 	/* Parse parameter */
 	args = g_strdupv(argv); /* support unicode filename */
@@ -502,12 +1944,26 @@ int main(int argc, char **argv) {
 		g_print("Version %.1f\n", VERSION);
 		goto out;
 	}
+	mark_stage(context, "startup", "start", timeline_process_start());
+	mark_stage(context, "startup", "options-parsed", g_get_monotonic_time());
 
 	if (script_file != NULL && !g_file_test(script_file, G_FILE_TEST_EXISTS)) {
 		g_printerr("No such script file: %s\n", script_file);
 		context->exit_code = 2;
 		goto out;
 	}	
+
+	/* load configuration */
+	config = config_load(config_file ? config_file : CONFIG_FILE, &error);
+	if (config == NULL) {
+		g_printerr("Invalid configuration: %s\n", error->message);
+		g_clear_error(&error);
+		context->exit_code = 5;
+		goto out;
+	}
+	mark_stage(context, "startup", "config-loaded", g_get_monotonic_time());
+	if (config->archive_enabled)
+		clear_staging_dir(config->staging_dir, config->bundle_suffix);
 	
 	/* connect to rauc */
 	context->installer =
@@ -525,15 +1981,20 @@ int main(int argc, char **argv) {
 	}
 	/* get system compatible string just once */
 	context->compatible = rauc_installer_dup_compatible(context->installer);
+	mark_stage(context, "startup", "rauc-ready", g_get_monotonic_time());
 	
 	/* register monitor for automatically mounted and unmounted devices */
 	context->monitor = udev_monitor_new();
+	g_signal_connect (context->monitor, "added", (GCallback)on_added, context);
 	g_signal_connect (context->monitor, "attach", (GCallback)on_attach, context);
 	g_signal_connect (context->monitor, "detach", (GCallback)on_detach, context);
+	apply_config(context, config);
+	mark_stage(context, "startup", "udev-ready", g_get_monotonic_time());
 	
 	context->loop = g_main_loop_new(NULL, FALSE);
 	g_unix_signal_add(SIGTERM, on_sigterm, context);
 	g_unix_signal_add(SIGINT, on_sigterm, context);
+	g_unix_signal_add(SIGHUP, on_sighup, context);
 	
 	/* aquire dbus name */
 	owner_id = g_bus_own_name(G_BUS_TYPE_SYSTEM,
@@ -551,6 +2012,19 @@ int main(int argc, char **argv) {
 	/* main loop leaved, cleanup */
 	g_main_loop_unref(context->loop);	
 	
+	/* stop a running decision */
+	g_mutex_lock(&context->lock);
+	if (context->decision_timeout)
+		g_source_remove(context->decision_timeout);
+	context->decision_timeout = 0;
+	if (context->decision_cancellable)
+		g_cancellable_cancel(context->decision_cancellable);
+	thread = context->decision_thread;
+	context->decision_thread = NULL;
+	g_mutex_unlock(&context->lock);
+	if (thread)
+		g_thread_join(thread);
+
 	/* free udev monitor */
 	g_signal_handlers_disconnect_by_data(context->monitor, context);
 	udev_monitor_quit(context->monitor);
@@ -563,6 +2037,19 @@ int main(int argc, char **argv) {
 	g_option_context_free(option_context);
 
 	exit_code = context->exit_code;
+	if (config)
+		config_unref(config);
+	if (context->config)
+		config_unref(context->config);
+	g_mutex_clear(&context->lock);
+	g_mutex_clear(&context->info_lock);
+	g_hash_table_destroy(context->failing_disks);
+	g_hash_table_destroy(context->timelines);
+	g_hash_table_destroy(context->media);
+	candidate_store_free(context->candidates);
+	g_hash_table_destroy(context->exported);
+	/* releases the bundles, this also removes their extracted files */
+	g_hash_table_destroy(context->bundles_by_disk);
 	g_free(context->compatible);
 	g_slice_free(MainContext, context);
 	return exit_code;
@@ -0,0 +1,165 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file timeline.c
+ * @date 2026-10-18
+ * @brief Monotonic timestamps of the stages of a session
+ *
+ * A session is the start of the daemon or the handling of an attached disk.
+ * Every stage is recorded with its CLOCK_MONOTONIC time in microseconds and
+ * logged with the structured journal fields
+ *
+ * DISK_UPDATER_SESSION   name of the session
+ * DISK_UPDATER_STAGE     name of the stage
+ * DISK_UPDATER_TIME_USEC monotonic time of the stage
+ * DISK_UPDATER_DELTA_USEC time since the first stage of the session
+ *
+ * so boot charts and field logs can be correlated with other services.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "timeline.h"
+
+typedef struct
+{
+	const gchar *stage; /* static string */
+	gint64 time;
+} Mark;
+
+struct _Timeline
+{
+	gchar *session;
+	GArray *marks; /* Mark */
+};
+
+
+/**
+ * @brief Creates a timeline without stages
+ *
+ * @param[in] name of the session
+ * @return Timeline, free with timeline_free()
+ */
+Timeline *
+timeline_new(const gchar *session)
+{
+	Timeline *timeline = g_slice_new0(Timeline);
+
+	timeline->session = g_strdup(session);
+	timeline->marks = g_array_new(FALSE, FALSE, sizeof(Mark));
+	return timeline;
+}
+
+/**
+ * @brief Frees a timeline
+ *
+ * @param[in] Timeline
+ */
+void
+timeline_free(Timeline *timeline)
+{
+	g_array_free(timeline->marks, TRUE);
+	g_free(timeline->session);
+	g_slice_free(Timeline, timeline);
+}
+
+/**
+ * @brief Records and logs a stage
+ *
+ * @param[in] Timeline
+ * @param[in] name of the stage, must be a static string
+ * @param[in] monotonic time of the stage, see g_get_monotonic_time()
+ */
+void
+timeline_mark(Timeline *timeline, const gchar *stage, gint64 time)
+{
+	Mark mark = { stage, time };
+	gint64 delta = 0;
+	g_autofree gchar *time_str = NULL;
+	g_autofree gchar *delta_str = NULL;
+
+	if (timeline->marks->len > 0)
+		delta = time - g_array_index(timeline->marks, Mark, 0).time;
+	g_array_append_val(timeline->marks, mark);
+
+	time_str = g_strdup_printf("%" G_GINT64_FORMAT, time);
+	delta_str = g_strdup_printf("%" G_GINT64_FORMAT, delta);
+	g_log_structured(G_LOG_DOMAIN, G_LOG_LEVEL_MESSAGE,
+	                 "DISK_UPDATER_SESSION", timeline->session,
+	                 "DISK_UPDATER_STAGE", stage,
+	                 "DISK_UPDATER_TIME_USEC", time_str,
+	                 "DISK_UPDATER_DELTA_USEC", delta_str,
+	                 "MESSAGE", "%10s %s +%" G_GINT64_FORMAT " ms",
+	                 stage, timeline->session, delta / 1000);
+}
+
+/**
+ * @brief Serializes the stages
+ *
+ * @param[in] Timeline
+ * @return floating GVariant of type a(st) with stage and monotonic time
+ */
+GVariant *
+timeline_serialize(Timeline *timeline)
+{
+	GVariantBuilder builder;
+	Mark *mark;
+	guint i;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a(st)"));
+	for (i = 0; i < timeline->marks->len; i++) {
+		mark = &g_array_index(timeline->marks, Mark, i);
+		g_variant_builder_add(&builder, "(st)", mark->stage, (guint64)mark->time);
+	}
+	return g_variant_builder_end(&builder);
+}
+
+/**
+ * @brief Returns the monotonic time the process was started
+ *
+ * The start time is read from /proc/self/stat in clock ticks of
+ * CLOCK_BOOTTIME, which also counts the time suspended. It is converted with
+ * the current offset between CLOCK_BOOTTIME and CLOCK_MONOTONIC. If this
+ * fails, the current time is returned.
+ *
+ * @return monotonic time in microseconds
+ */
+gint64
+timeline_process_start(void)
+{
+	g_autofree gchar *stat = NULL;
+	g_auto(GStrv) fields = NULL;
+	const gchar *comm_end;
+	struct timespec boottime, monotonic;
+	gint64 now = g_get_monotonic_time();
+	gint64 start, offset;
+	guint64 ticks;
+
+	if (!g_file_get_contents("/proc/self/stat", &stat, NULL, NULL))
+		return now;
+
+	/* the command name may contain spaces, the fields start after ')' */
+	comm_end = strrchr(stat, ')');
+	if (comm_end == NULL)
+		return now;
+
+	/* starttime is field 22, the 20th after the command name */
+	fields = g_strsplit(comm_end + 2, " ", 21);
+	if (g_strv_length(fields) < 20)
+		return now;
+
+	if (clock_gettime(CLOCK_BOOTTIME, &boottime) != 0 ||
+	    clock_gettime(CLOCK_MONOTONIC, &monotonic) != 0)
+		return now;
+	offset = (boottime.tv_sec - monotonic.tv_sec) * G_USEC_PER_SEC +
+	         (boottime.tv_nsec - monotonic.tv_nsec) / 1000;
+
+	ticks = g_ascii_strtoull(fields[19], NULL, 10);
+	start = (gint64)(ticks * G_USEC_PER_SEC / sysconf(_SC_CLK_TCK)) - offset;
+
+	/* clock ticks are coarse, the start must not be ahead of the first stage */
+	return MIN(start, now);
+}
@@ -12,6 +12,7 @@
  * ------
  * 
  * > UdevMonitor *monitor = udev_monitor_new (void);
+ * > udev_monitor_set_config(monitor, config);
  * > g_signal_connect (monitor, "attach", (GCallback)on_attach, data);
  * > ...
  * > g_signal_handlers_disconnect_by_data(monitor, data);
@@ -21,38 +22,83 @@
  * Signals
  * -------
  *
+ * added    UdevMonitor *monitor
+ *          GUdevDevice *device
+ *
  * attach   UdevMonitor *monitor
  *          GUdevDevice *device
  *          GSList of gchar *mount_points
  *          GCancellable *cancellable
+ *          UdevTimes *times
  *
  * detach   UdevMonitor *monitor
  *          GSList of gchar *mount_points
  *          GUdevDevice *device
+ *
+ * Scheduling
+ * ----------
+ *
+ * The attach signal (mounting, scanning and verifying) of each disk is
+ * emitted from a thread pool of `[resources] max-devices` threads, so disks
+ * on independent buses are processed in parallel. Disks sharing the
+ * bandwidth of a link (all devices of a USB 2.0 bus, the devices behind a
+ * root port of a SuperSpeed bus) are limited to `[resources] max-per-link`
+ * concurrent attaches. The processing thread keeps the other disks of a
+ * link in a waiting queue and hands them to the pool when a slot is free, so
+ * waiting disks do not occupy pool threads. The detach signal of a disk is
+ * emitted after its attach returned and only if the attach was emitted. A
+ * disk removed during its attach is detached by the pool thread when the
+ * attach returns, so the processing thread never waits for an attach.
+ *
+ * The added signal is emitted from the main loop for every new disk. From
+ * then until its attach returned or it is removed, the disk is counted by
+ * udev_monitor_get_pending().
  */
 
 #include <sys/mount.h>
 #include <errno.h>
+#include <string.h>
+#include "prefetch.h"
 #include "udev.h"
 #include <gio/gio.h>
 
-#define DISK_ID(d) g_udev_device_get_property(device, "ID_PART_TABLE_UUID")
+/* kernel name, unique among the present disks */
+#define DISK_ID(d) g_udev_device_get_name(d)
 #define NEW_DISK_ID(d) g_strdup(DISK_ID(d))
 
-#define UDEV_TIMEOUT 1.0f
 typedef struct
 {
+	UdevMonitor *monitor;
 	gboolean attached;
 	GUdevDevice *gudev_device;
 	GCancellable *cancellable;
 	GSList *partitions; /* GUdevDevice */
 	GSList *mount_points; /*gchar */
 	GTimer *initialized;
+	UdevTimes times;
+	UdevTopology topology;
+	gboolean announced; /* attach signal emitted */
+	gboolean busy; /* attach queued or running, protected by links_lock */
+	gboolean removed; /* detach at the end of the attach, protected by links_lock */
+	gboolean pending; /* counted in pending, protected by links_lock */
 } Disk;
 
+typedef struct
+{
+	guint active; /* attaches handed to the pool */
+	GQueue waiting; /* Disk, attaches waiting for a slot */
+} Link;
+
+typedef struct
+{
+	Disk *disk;
+	gboolean attach;
+} DiskEvent;
+
 
 enum
 {
+  ADDED,
   ATTACH,
   DETACH,
   LAST_SIGNAL
@@ -64,13 +110,41 @@ struct _UdevMonitor
 {
 	GObject parent_object;
 	GUdevClient *gudev_client;
-	GAsyncQueue *process_device_queue;
+	GAsyncQueue *process_device_queue; /* DiskEvent */
 	GThread *process_device_thread;
+	GThreadPool *attach_pool;
 	GHashTable *disks;
+	GMutex config_lock;
+	Config *config;
+	GMutex links_lock;
+	GHashTable *links; /* link key -> Link */
+	gboolean quitting; /* no further attaches, protected by links_lock */
+	guint pending; /* disks not attached yet, protected by links_lock */
 };
 G_DEFINE_TYPE(UdevMonitor, udev_monitor, G_TYPE_OBJECT);
 
 
+/**
+ * @brief Returns a reference of the current configuration
+ *
+ * The configuration can be replaced from the main thread at any time, so
+ * the processing thread must hold its own reference.
+ *
+ * @param[in] UdevMonitor instance
+ * @return Config struct, release with config_unref()
+ */
+static Config *
+get_config(UdevMonitor *self)
+{
+	Config *config;
+
+	g_mutex_lock(&self->config_lock);
+	config = config_ref(self->config);
+	g_mutex_unlock(&self->config_lock);
+	return config;
+}
+
+
 /**
  * @brief Checks, if a specific fstype is supported by the OS
  *
@@ -123,6 +197,100 @@ is_in_filesystem_file (const gchar *filesystems_file,
 	return ret;
 }
 
+/**
+ * @brief Reads the filesystem metadata of a partition ahead
+ *
+ * Only FAT is supported, which is the filesystem of most sticks and cards.
+ *
+ * @param[in] device file of the partition
+ * @param[in] filesystem type
+ */
+static void
+prefetch_partition(const gchar *path, const gchar *type)
+{
+	GError *error = NULL;
+	guint64 bytes = 0;
+	gint64 started = g_get_monotonic_time();
+
+	if (g_strcmp0(type, "vfat"))
+		return;
+
+	if (!prefetch_fat_metadata(path, &bytes, &error)) {
+		g_warning("No metadata prefetch of %s: %s", path, error->message);
+		g_clear_error(&error);
+		return;
+	}
+	g_debug("Prefetched %" G_GUINT64_FORMAT " bytes of %s metadata in %.1f ms",
+	        bytes, path, (g_get_monotonic_time() - started) / 1000.0);
+}
+
+/* generic mount options, which mount(2) expects as flags */
+static const struct
+{
+	const gchar *name;
+	unsigned long set;
+	unsigned long clear;
+} mount_flags[] = {
+	{ "ro",         MS_RDONLY,     0 },
+	{ "rw",         0,             MS_RDONLY },
+	{ "nosuid",     MS_NOSUID,     0 },
+	{ "suid",       0,             MS_NOSUID },
+	{ "nodev",      MS_NODEV,      0 },
+	{ "dev",        0,             MS_NODEV },
+	{ "noexec",     MS_NOEXEC,     0 },
+	{ "exec",       0,             MS_NOEXEC },
+	{ "sync",       MS_SYNCHRONOUS, 0 },
+	{ "async",      0,             MS_SYNCHRONOUS },
+	{ "dirsync",    MS_DIRSYNC,    0 },
+	{ "noatime",    MS_NOATIME,    0 },
+	{ "atime",      0,             MS_NOATIME },
+	{ "nodiratime", MS_NODIRATIME, 0 },
+	{ "diratime",   0,             MS_NODIRATIME },
+	{ "relatime",   MS_RELATIME,   0 },
+	{ "norelatime", 0,             MS_RELATIME },
+};
+
+/**
+ * @brief Splits mount options into mount(2) flags and filesystem data
+ *
+ * Generic options like `nosuid` are not understood by the filesystems, so
+ * they are converted to flags. All other options are passed on as data.
+ *
+ * @param[in] comma separated options
+ * @param[in,out] flags of mount(2)
+ * @return filesystem specific options, release with g_free()
+ */
+static gchar *
+parse_mount_options(const gchar *options, unsigned long *flags)
+{
+	g_auto(GStrv) tokens = g_strsplit(options ? options : "", ",", -1);
+	GString *data = g_string_new(NULL);
+
+	for (guint n = 0; tokens[n] != NULL; n++) {
+		gchar *option = g_strstrip(tokens[n]);
+		gboolean generic = FALSE;
+
+		if (*option == '\0')
+			continue;
+
+		for (guint i = 0; i < G_N_ELEMENTS(mount_flags); i++) {
+			if (g_strcmp0(option, mount_flags[i].name))
+				continue;
+			*flags = (*flags & ~mount_flags[i].clear) | mount_flags[i].set;
+			generic = TRUE;
+			break;
+		}
+		if (generic)
+			continue;
+
+		if (data->len > 0)
+			g_string_append_c(data, ',');
+		g_string_append(data, option);
+	}
+
+	return g_string_free(data, FALSE);
+}
+
 /**
  * @brief Mounts a partition of a disk
  *
@@ -137,10 +305,13 @@ mount_partition(gpointer data, gpointer user_data)
 {
 	GUdevDevice *gudev_device = G_UDEV_DEVICE(data);
 	Disk *disk = (Disk *)user_data;
+	g_autoptr(Config) config = get_config(disk->monitor);
 	const gchar* path;
 	const gchar* name;
 	const gchar* type;
 	gchar* mount_dir;
+	g_autofree gchar *mount_data = NULL;
+	unsigned long flags = 0;
 
 	path = g_udev_device_get_device_file(gudev_device);
 	name = g_udev_device_get_name (gudev_device);
@@ -149,8 +320,8 @@ mount_partition(gpointer data, gpointer user_data)
 	if(!is_in_filesystem_file ("/proc/filesystems", type)) {
 		return; /* type not supported by OS */
 	}
-	
-	mount_dir = g_strdup_printf("/run/media/disk-updater/%s", name);
+
+	mount_dir = g_build_filename(config->mount_base, name, NULL);
 	
 	if(g_mkdir_with_parents (mount_dir, 0755) != 0 && errno != EEXIST) {
 		g_warning("Could not create directory %s", mount_dir);
@@ -158,12 +329,20 @@ mount_partition(gpointer data, gpointer user_data)
 		return;
 	}
 		
-	if(0 != mount(path, mount_dir, type, 0 , "")) {
+	mount_data = parse_mount_options(config->mount_options, &flags);
+	if (config->mount_read_only)
+		flags |= MS_RDONLY;
+
+	if(0 != mount(path, mount_dir, type, flags, mount_data)) {
 		g_warning("Could not mount %s", path);
 		g_free(mount_dir);
 		return;
 	}
 
+	/* mounting sets the block size of the device, which drops its cache */
+	if (config->prefetch_metadata)
+		prefetch_partition(path, type);
+
 	disk->mount_points = g_slist_prepend(disk->mount_points, mount_dir);
 }
 
@@ -185,6 +364,22 @@ umount_partition(gpointer data, gpointer user_data)
 	}
 }
 
+/**
+ * @brief Lazily unmounts the partitions of an attached disk
+ *
+ * Used for failing media: the mount points are detached at once, so no
+ * further access blocks in the error handling of the kernel. The disk stays
+ * known until it is removed.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] GSList of mount points passed with the attach signal
+ */
+void
+udev_monitor_unmount(UdevMonitor *self, gpointer mount_points)
+{
+	g_slist_foreach((GSList *)mount_points, umount_partition, NULL);
+}
+
 /**
  * @brief free the disk struct
  *
@@ -201,11 +396,208 @@ free_disk(Disk *disk)
 	g_object_unref(disk->gudev_device);
 	g_object_unref(disk->cancellable);
 	g_timer_destroy(disk->initialized);
+	udev_topology_clear(&disk->topology);
 	g_slice_free(Disk, disk);
 }
 
 /**
- * @brief Loop for mounting, umounting and emiting signals
+ * @brief Stops counting a disk as pending
+ *
+ * Call with the links lock held.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Disk struct
+ */
+static void
+clear_pending(UdevMonitor *self, Disk *disk)
+{
+	if (disk->pending) {
+		disk->pending = FALSE;
+		self->pending--;
+	}
+}
+
+/**
+ * @brief Emits the detach signal of a disk and frees it
+ *
+ * The signal is only emitted if the attach signal was emitted.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Disk struct
+ */
+static void
+detach_disk(UdevMonitor *self, Disk *disk)
+{
+	g_mutex_lock(&self->links_lock);
+	clear_pending(self, disk);
+	g_mutex_unlock(&self->links_lock);
+
+	if (disk->announced)
+		g_signal_emit (self, signals[DETACH], 0,
+		               disk->gudev_device);
+	free_disk(disk);
+}
+
+/**
+ * @brief Queues an attach or detach of a disk for the processing thread
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Disk struct
+ * @param[in] TRUE for attach, FALSE for detach
+ */
+static void
+push_event(UdevMonitor *self, Disk *disk, gboolean attach)
+{
+	DiskEvent *event = g_slice_new(DiskEvent);
+
+	event->disk = disk;
+	event->attach = attach;
+	g_async_queue_push(self->process_device_queue, event);
+}
+
+static void
+free_link(gpointer data)
+{
+	Link *link = data;
+
+	g_queue_clear(&link->waiting);
+	g_slice_free(Link, link);
+}
+
+/**
+ * @brief Hands the waiting disks of a link to the pool while slots are free
+ *
+ * Call with the links lock held.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Link struct
+ */
+static void
+dispatch_waiting(UdevMonitor *self, Link *link)
+{
+	g_autoptr(Config) config = get_config(self);
+
+	while (!self->quitting && !g_queue_is_empty(&link->waiting) &&
+	       (config->max_per_link == 0 || link->active < config->max_per_link)) {
+		link->active++;
+		g_thread_pool_push(self->attach_pool,
+		                   g_queue_pop_head(&link->waiting), NULL);
+	}
+}
+
+/**
+ * @brief Queues the attach of a disk on its link
+ *
+ * The attach is handed to the pool at once if the link has a free slot,
+ * otherwise when an attach of the link returns.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Disk struct
+ */
+static void
+queue_attach(UdevMonitor *self, Disk *disk)
+{
+	const gchar *key = disk->topology.link;
+	Link *link;
+
+	g_mutex_lock(&self->links_lock);
+	link = g_hash_table_lookup(self->links, key);
+	if (link == NULL) {
+		link = g_slice_new0(Link);
+		g_hash_table_insert(self->links, g_strdup(key), link);
+	}
+	disk->busy = TRUE;
+	g_queue_push_tail(&link->waiting, disk);
+	dispatch_waiting(self, link);
+	if (!g_queue_is_empty(&link->waiting))
+		g_debug("Disk %s waits for link %s",
+		        g_udev_device_get_name(disk->gudev_device), key);
+	g_mutex_unlock(&self->links_lock);
+}
+
+/**
+ * @brief Removes a disk from the waiting queue of its link
+ *
+ * Call with the links lock held.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Disk struct
+ * @return TRUE if the disk was waiting, its attach is not emitted
+ */
+static gboolean
+unqueue_attach(UdevMonitor *self, Disk *disk)
+{
+	Link *link = g_hash_table_lookup(self->links, disk->topology.link);
+
+	if (link == NULL || !g_queue_remove(&link->waiting, disk))
+		return FALSE;
+	if (link->active == 0 && g_queue_is_empty(&link->waiting))
+		g_hash_table_remove(self->links, disk->topology.link);
+	disk->busy = FALSE;
+	return TRUE;
+}
+
+/**
+ * @brief Releases the slot of the link of a disk
+ *
+ * The next waiting disk of the link is handed to the pool. The attach of
+ * the disk returned, so it is no longer pending.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Disk struct
+ * @return TRUE if the disk was removed during the attach
+ */
+static gboolean
+release_link(UdevMonitor *self, Disk *disk)
+{
+	const gchar *key = disk->topology.link;
+	gboolean removed;
+	Link *link;
+
+	g_mutex_lock(&self->links_lock);
+	link = g_hash_table_lookup(self->links, key);
+	link->active--;
+	dispatch_waiting(self, link);
+	if (link->active == 0 && g_queue_is_empty(&link->waiting))
+		g_hash_table_remove(self->links, key);
+	disk->busy = FALSE;
+	clear_pending(self, disk);
+	removed = disk->removed;
+	g_mutex_unlock(&self->links_lock);
+	return removed;
+}
+
+/**
+ * @brief Thread pool function mounting a disk and emitting the attach signal
+ *
+ * @param[in] Disk struct
+ * @param[in] UdevMonitor instance
+ */
+static void
+attach_disk(gpointer data, gpointer user_data)
+{
+	UdevMonitor *self = UDEV_MONITOR(user_data);
+	Disk *disk = (Disk *)data;
+
+	if (!g_cancellable_is_cancelled(disk->cancellable)) {
+		g_slist_foreach(disk->partitions, mount_partition, disk);
+		disk->times.mounted = g_get_monotonic_time();
+		disk->announced = TRUE;
+
+		g_signal_emit (self, signals[ATTACH], 0,
+		               disk->gudev_device,
+		               disk->mount_points,
+		               disk->cancellable,
+		               &disk->times);
+	}
+
+	/* the processing thread left the detach to this thread */
+	if (release_link(self, disk))
+		detach_disk(self, disk);
+}
+
+/**
+ * @brief Loop for dispatching attaches, umounting and emiting signals
  *
  * @param[in] UdevMonitor struct
  * @return NULL on exit
@@ -214,29 +606,33 @@ static gpointer
 process_disk_thread_func (gpointer user_data)
 {
 	UdevMonitor *self = UDEV_MONITOR(user_data);
+	DiskEvent *event;
+	gboolean busy;
 	Disk *disk;
 	
 	do {
-		disk = g_async_queue_pop (self->process_device_queue);
+		event = g_async_queue_pop (self->process_device_queue);
 		
 		/* used by _finalize() to stop this thread - if received, we can no
 		 * longer use @monitor
 		 */
-		if (disk == (gpointer) 0xdeadbeef)
+		if (event == (gpointer) 0xdeadbeef)
 			goto out;
 
-		if(disk->attached) {
-			g_slist_foreach(disk->partitions, mount_partition, disk);
-
-			g_signal_emit (self, signals[ATTACH], 0,
-			               disk->gudev_device,
-                           disk->mount_points,
-			               disk->cancellable);
+		disk = event->disk;
+		if(event->attach) {
+			queue_attach(self, disk);
 		} else {
-			g_signal_emit (self, signals[DETACH], 0,
-			               disk->gudev_device);
-			free_disk(disk);
+			/* a running attach is cancelled and detaches the disk at its end */
+			g_mutex_lock(&self->links_lock);
+			unqueue_attach(self, disk);
+			busy = disk->removed = disk->busy;
+			g_mutex_unlock(&self->links_lock);
+
+			if (!busy)
+				detach_disk(self, disk);
 		}
+		g_slice_free(DiskEvent, event);
 	} while (TRUE);
 
  out:
@@ -249,9 +645,9 @@ process_disk_thread_func (gpointer user_data)
  * Not every udev/kernel binds the block device after adding all partition
  * devices. It can not be said, whether all partitions are already added by udev
  * or futher ones will be added. Therefore, this function is called delayed and
- * checks, whether no further partitions were added since one second
- * (UDEV_TIMEOUT). If this is the case, the disk are handed over to the thread,
- * which mounts the partitions.
+ * checks, whether no further partitions were added since the settle timeout
+ * (`[settle] timeout`). If this is the case, the disk are handed over to the
+ * thread, which mounts the partitions.
  *
  * @param[in] UdevMonitor struct
  * @return TRUE, if the function has to be called again, otherwise FALSE.
@@ -260,19 +656,22 @@ gboolean
 on_disk_initialized(gpointer user_data)
 {
 	UdevMonitor *self = UDEV_MONITOR(user_data);
+	g_autoptr(Config) config = get_config(self);
 	gpointer key, value;
 	GHashTableIter iter;
 	Disk *disk;
 	g_hash_table_iter_init (&iter, self->disks);
 	while (g_hash_table_iter_next (&iter, &key, &value)) {
 		disk = (Disk *)value;
-		if(!disk->attached && g_timer_elapsed(disk->initialized, NULL) > UDEV_TIMEOUT) {
+		if(!disk->attached &&
+		   g_timer_elapsed(disk->initialized, NULL) > config->settle_timeout) {
 			disk->attached = TRUE;
-			g_async_queue_push (self->process_device_queue, disk);
+			disk->times.settled = g_get_monotonic_time();
+			push_event(self, disk, TRUE);
 			return FALSE;
 		}
 	}
-		return TRUE; /* no disk found..wait another second */
+		return TRUE; /* no disk found..wait another settle timeout */
 }
 
 
@@ -291,6 +690,8 @@ on_uevent (GUdevClient *client,
            gpointer user_data)
 {
 	UdevMonitor *self = UDEV_MONITOR(user_data);
+	g_autoptr(Config) config = get_config(self);
+	g_autoptr(GUdevDevice) parent = NULL;
 	Disk *disk = NULL;
 	gchar *key = NULL;
 
@@ -305,16 +706,31 @@ on_uevent (GUdevClient *client,
 		if(!g_strcmp0 (devtype, "disk")) {
 			/* new disk */
 			disk = g_slice_new0 (Disk);
+			disk->monitor = self;
 			disk->gudev_device = g_object_ref (device);
 			disk->cancellable = g_cancellable_new ();
 			disk->attached = FALSE;
 			disk->initialized = g_timer_new();
+			disk->times.uevent = g_get_monotonic_time();
+			udev_device_get_topology(device, &disk->topology);
+			g_debug("Disk %s on link %s (hub %s, root port %u, %.0f Mbit/s)",
+			        DISK_ID(device), disk->topology.link,
+			        disk->topology.hub ? disk->topology.hub : "none",
+			        disk->topology.root_port, disk->topology.speed);
 			g_hash_table_insert(self->disks, NEW_DISK_ID(device), disk);
-			g_timeout_add_seconds(UDEV_TIMEOUT, on_disk_initialized, self);
+			g_mutex_lock(&self->links_lock);
+			disk->pending = TRUE;
+			self->pending++;
+			g_mutex_unlock(&self->links_lock);
+			g_timeout_add((guint)(config->settle_timeout * 1000),
+			              on_disk_initialized, self);
+			g_signal_emit (self, signals[ADDED], 0, device);
 		}
 		else if(!g_strcmp0 (devtype, "partition")) {			
 			/* new partition */
-			disk = g_hash_table_lookup(self->disks, DISK_ID(device));			
+			parent = g_udev_device_get_parent(device);
+			if (parent)
+				disk = g_hash_table_lookup(self->disks, DISK_ID(parent));
 			if(disk && !disk->attached) {
 				g_timer_start(disk->initialized);
 				disk->partitions = g_slist_prepend(disk->partitions,
@@ -331,9 +747,8 @@ on_uevent (GUdevClient *client,
 		                               (gpointer *) &key,
 		                               (gpointer *) &disk)) {
 			g_free(key);
-			disk->attached = FALSE;
 			g_cancellable_cancel(disk->cancellable);
-			g_async_queue_push (self->process_device_queue, disk);
+			push_event(self, disk, FALSE);
 		}
 	}
 }
@@ -370,6 +785,12 @@ udev_monitor_quit(UdevMonitor *self)
 	g_async_queue_push_front(self->process_device_queue, (gpointer)0xdeadbeef);
 	g_hash_table_foreach (self->disks, cancel_disk, NULL);
 	g_thread_join(self->process_device_thread);
+	/* waiting attaches are dropped, queued ones return at once */
+	g_mutex_lock(&self->links_lock);
+	self->quitting = TRUE;
+	g_mutex_unlock(&self->links_lock);
+	g_thread_pool_free(self->attach_pool, FALSE, TRUE);
+	self->attach_pool = NULL;
 }
 
 
@@ -387,6 +808,10 @@ udev_monitor_finalize (GObject *gobject)
 	g_async_queue_unref(self->process_device_queue);
 	g_object_unref(self->gudev_client);
 	g_hash_table_destroy(self->disks); /* also umount */
+	config_unref(self->config);
+	g_mutex_clear(&self->config_lock);
+	g_hash_table_destroy(self->links);
+	g_mutex_clear(&self->links_lock);
 	G_OBJECT_CLASS (udev_monitor_parent_class)->finalize (gobject);
 }
 
@@ -402,6 +827,18 @@ udev_monitor_class_init (UdevMonitorClass *klass)
 	GObjectClass *object_class = G_OBJECT_CLASS (klass);	
 	object_class->finalize = udev_monitor_finalize;
 	
+	signals[ADDED] = g_signal_new ("added",
+	                               G_TYPE_FROM_CLASS (klass),
+	                               G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE |
+	                               G_SIGNAL_NO_HOOKS,
+	                               0 /* class offset */,
+	                               NULL /* accumulator */,
+	                               NULL /* accumulator data */,
+	                               NULL /* C marshaller */,
+	                               G_TYPE_NONE /* return_type */,
+	                               1     /* n_params */,
+	                               G_UDEV_TYPE_DEVICE /* param_types */);
+
 	signals[ATTACH] = g_signal_new ("attach",
 	                                G_TYPE_FROM_CLASS (klass),
 	                                G_SIGNAL_RUN_LAST | G_SIGNAL_NO_RECURSE |
@@ -411,10 +848,11 @@ udev_monitor_class_init (UdevMonitorClass *klass)
 	                                NULL /* accumulator data */,
 	                                NULL /* C marshaller */,
 	                                G_TYPE_NONE /* return_type */,
-	                                3     /* n_params */,
+	                                4     /* n_params */,
 	                                G_UDEV_TYPE_DEVICE,
 	                                G_TYPE_POINTER,
-	                                G_TYPE_CANCELLABLE/* param_types */);
+	                                G_TYPE_CANCELLABLE,
+	                                G_TYPE_POINTER /* param_types */);
 
 	signals[DETACH] = g_signal_new ("detach",
 	                                G_TYPE_FROM_CLASS (klass),
@@ -447,6 +885,18 @@ udev_monitor_init (UdevMonitor *self)
 	                                    (GDestroyNotify)g_free,
 	                                    (GDestroyNotify)free_disk);
 
+	g_mutex_init(&self->config_lock);
+	self->config = config_new_default();
+
+	g_mutex_init(&self->links_lock);
+	self->links = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_link);
+	self->attach_pool = g_thread_pool_new(attach_disk,
+	                                      self,
+	                                      self->config->max_devices ?
+	                                      (gint)self->config->max_devices : -1,
+	                                      FALSE,
+	                                      NULL);
+
 	/* get ourselves an udev client */
 	self->gudev_client = g_udev_client_new (subsystems);
 
@@ -461,6 +911,175 @@ udev_monitor_init (UdevMonitor *self)
 	                                            self);
 }
 
+/**
+ * @brief Replaces the configuration
+ *
+ * The new settings apply to disks attached afterwards. Already attached disks
+ * keep their mount points.
+ *
+ * @param[in] UdevMonitor instance
+ * @param[in] Config struct, a new reference is taken
+ */
+void
+udev_monitor_set_config(UdevMonitor *self, Config *config)
+{
+	GHashTableIter iter;
+	gpointer link;
+	Config *old;
+
+	g_mutex_lock(&self->config_lock);
+	old = self->config;
+	self->config = config_ref(config);
+	g_mutex_unlock(&self->config_lock);
+	config_unref(old);
+
+	g_thread_pool_set_max_threads(self->attach_pool,
+	                              config->max_devices ?
+	                              (gint)config->max_devices : -1,
+	                              NULL);
+	/* a raised limit per link frees slots for waiting disks */
+	g_mutex_lock(&self->links_lock);
+	g_hash_table_iter_init(&iter, self->links);
+	while (g_hash_table_iter_next(&iter, NULL, &link))
+		dispatch_waiting(self, link);
+	g_mutex_unlock(&self->links_lock);
+}
+
+/**
+ * @brief Returns the number of disks whose attach did not return yet
+ *
+ * Counts the disks from their uevent on: settling, waiting for a slot of
+ * their link, mounting and scanning.
+ *
+ * @param[in] UdevMonitor instance
+ * @return number of pending disks
+ */
+guint
+udev_monitor_get_pending(UdevMonitor *self)
+{
+	guint pending;
+
+	g_mutex_lock(&self->links_lock);
+	pending = self->pending;
+	g_mutex_unlock(&self->links_lock);
+	return pending;
+}
+
+/**
+ * @brief Reads the position of a disk in the bus topology from sysfs
+ *
+ * A USB 2.0 bus is shared by all its devices, the link is the bus. On a
+ * SuperSpeed bus, every root port has its own bandwidth, which is shared by
+ * the devices behind a hub on that port. SD-cards share their host
+ * controller, other disks are treated as independent.
+ *
+ * @param[in] GUdevDevice of the disk
+ * @param[out] UdevTopology struct, free the members with udev_topology_clear()
+ */
+void
+udev_device_get_topology(GUdevDevice *device, UdevTopology *topology)
+{
+	g_autoptr(GUdevDevice) usb = NULL;
+	g_autoptr(GUdevDevice) hub = NULL;
+	g_autoptr(GUdevDevice) mmc = NULL;
+	const gchar *devpath;
+	const gchar *name;
+	gint busnum;
+
+	memset(topology, 0, sizeof(*topology));
+
+	usb = g_udev_device_get_parent_with_subsystem(device, "usb", "usb_device");
+	if (usb != NULL) {
+		topology->bus = UDEV_BUS_USB;
+		topology->speed = g_udev_device_get_sysfs_attr_as_double(usb, "speed");
+		busnum = g_udev_device_get_sysfs_attr_as_int(usb, "busnum");
+
+		/* devpath is the chain of ports below the root hub, e.g. 2.4.1 */
+		devpath = g_udev_device_get_sysfs_attr(usb, "devpath");
+		if (devpath != NULL)
+			topology->root_port = g_ascii_strtoull(devpath, NULL, 10);
+
+		hub = g_udev_device_get_parent_with_subsystem(usb, "usb", "usb_device");
+		if (hub != NULL)
+			topology->hub = g_strdup(g_udev_device_get_name(hub));
+
+		if (topology->speed > 480)
+			topology->link = g_strdup_printf("usb%d-%u", busnum,
+			                                 topology->root_port);
+		else
+			topology->link = g_strdup_printf("usb%d", busnum);
+		return;
+	}
+
+	mmc = g_udev_device_get_parent_with_subsystem(device, "mmc", NULL);
+	if (mmc != NULL) {
+		/* card devices are named <host>:<address> */
+		name = g_udev_device_get_name(mmc);
+		topology->bus = UDEV_BUS_MMC;
+		topology->link = g_strndup(name, strcspn(name, ":"));
+		return;
+	}
+
+	topology->link = g_strdup(g_udev_device_get_name(device));
+}
+
+/**
+ * @brief Returns the id of a disk passed with the attach and detach signals
+ *
+ * The kernel name is unique among the present disks, the sequence number of
+ * the add uevent tells it apart from a later disk with the same name. Unlike
+ * ID_PART_TABLE_UUID, the id also differs for disks cloned with dd.
+ *
+ * @param[in] GUdevDevice of the disk as passed with the signals
+ * @return disk id, free with g_free()
+ */
+gchar *
+udev_device_get_disk_id(GUdevDevice *device)
+{
+	return g_strdup_printf("%s-%" G_GUINT64_FORMAT,
+	                       g_udev_device_get_name(device),
+	                       g_udev_device_get_seqnum(device));
+}
+
+/**
+ * @brief Frees the members of a topology
+ *
+ * @param[in] UdevTopology struct
+ */
+void
+udev_topology_clear(UdevTopology *topology)
+{
+	g_clear_pointer(&topology->link, g_free);
+	g_clear_pointer(&topology->hub, g_free);
+}
+
+/**
+ * @brief Estimates the read throughput of a disk from its bus
+ *
+ * USB disks are rated by the negotiated link speed of their USB device
+ * (sysfs attribute `speed` in Mbit/s) with a typical protocol efficiency,
+ * SD-cards and eMMC are assumed to run in high speed mode. The value is only
+ * used to rank media against each other.
+ *
+ * @param[in] GUdevDevice of the disk
+ * @return expected throughput in bytes per second
+ */
+gdouble
+udev_device_get_expected_throughput(GUdevDevice *device)
+{
+	UdevTopology topology;
+	gdouble throughput = 10e6;
+
+	udev_device_get_topology(device, &topology);
+	if (topology.bus == UDEV_BUS_USB && topology.speed > 0)
+		throughput = topology.speed * 1e6 / 8 * 0.7;
+	else if (topology.bus == UDEV_BUS_MMC)
+		throughput = 20e6;
+	udev_topology_clear(&topology);
+
+	return throughput;
+}
+
 /**
  * @brief Helper function for constructing an UdevMonitor instance
  *
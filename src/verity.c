@@ -0,0 +1,348 @@
+/**
+ * SPDX-License-Identifier: MIT
+ *
+ * Copyright (c) 2026 Helbling Technik GmbH
+ *
+ * @file verity.c
+ * @date 2026-10-18
+ * @brief Parallel check of the hash tree of verity bundles
+ *
+ * The payload of a verity bundle is the squashfs image followed by its
+ * dm-verity hash tree (SHA-256, 4096 byte blocks, salt prepended to every
+ * hashed block). The highest level of the tree is stored first, the root
+ * hash, the salt and the size of the tree are part of the manifest:
+ *
+ * > +-------+------------------------------+-----------+------+
+ * > | image | tree: level n ... level 0    | signature | size |
+ * > +-------+------------------------------+-----------+------+
+ *
+ * The manifest is embedded in the CMS signature as plain text, so its values
+ * are read without parsing the CMS. The signature itself is not verified
+ * here, this is still done by rauc. The pre-validation only rejects copies
+ * whose content does not match the manifest, before the much slower
+ * sequential verification of rauc is started.
+ *
+ * The tree is read into memory and its upper levels are checked against the
+ * root hash first. The image is then split into chunks, which are hashed by
+ * several threads against level 0. The first mismatch stops all threads.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "bundle-file.h"
+#include "verity.h"
+
+#define BLOCK_SIZE 4096
+#define DIGEST_SIZE 32
+#define HASHES_PER_BLOCK (BLOCK_SIZE / DIGEST_SIZE)
+#define MAX_LEVELS 16
+#define MAX_SALT_SIZE 256
+#define MAX_TREE_SIZE (256 * 1024 * 1024)
+#define CHUNK_BLOCKS 1024 /* 4 MiB per read */
+
+G_DEFINE_QUARK (verity-error-quark, verity_error)
+
+typedef struct
+{
+	const gchar *path;
+	gint fd;
+	guint8 salt[MAX_SALT_SIZE];
+	gsize salt_size;
+	guint64 data_blocks;
+	const guint8 *hashes;     /* level 0 of the tree, one digest per block */
+	gint next_chunk;          /* atomic, next chunk to check */
+	gint chunks;
+	gint failed;              /* atomic, stops all workers */
+	GCancellable *cancellable;
+	GMutex lock;              /* protects error */
+	GError *error;            /* first error of the workers */
+} Verification;
+
+/**
+ * @brief Decodes a hex string
+ *
+ * @param[in] hex string
+ * @param[out] buffer
+ * @param[in] size of the buffer
+ * @return number of decoded bytes or -1 if the string is invalid
+ */
+static gssize
+decode_hex(const gchar *hex, guint8 *buffer, gsize size)
+{
+	gsize len = strlen(hex);
+	gsize i;
+	gint hi, lo;
+
+	if (len % 2 || len / 2 > size)
+		return -1;
+
+	for (i = 0; i < len / 2; i++) {
+		hi = g_ascii_xdigit_value(hex[2 * i]);
+		lo = g_ascii_xdigit_value(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		buffer[i] = hi << 4 | lo;
+	}
+	return len / 2;
+}
+
+/**
+ * @brief Hashes a block with the salt prepended
+ *
+ * @param[in] checksum object, reset here
+ * @param[in] Verification struct
+ * @param[in] block of BLOCK_SIZE bytes
+ * @param[out] digest of DIGEST_SIZE bytes
+ */
+static void
+hash_block(GChecksum *checksum, const Verification *v,
+           const guint8 *block, guint8 *digest)
+{
+	gsize len = DIGEST_SIZE;
+
+	g_checksum_reset(checksum);
+	g_checksum_update(checksum, v->salt, v->salt_size);
+	g_checksum_update(checksum, block, BLOCK_SIZE);
+	g_checksum_get_digest(checksum, digest, &len);
+}
+
+/**
+ * @brief Records the first error of a worker and stops the others
+ *
+ * @param[in] Verification struct
+ * @param[in] error, ownership is taken
+ */
+static void
+fail(Verification *v, GError *error)
+{
+	g_mutex_lock(&v->lock);
+	if (v->error == NULL)
+		v->error = error;
+	else
+		g_error_free(error);
+	g_mutex_unlock(&v->lock);
+	g_atomic_int_set(&v->failed, 1);
+}
+
+/**
+ * @brief Worker checking chunks of the image against level 0
+ *
+ * @param[in] Verification struct
+ * @return NULL
+ */
+static gpointer
+check_chunks(gpointer data)
+{
+	Verification *v = data;
+	g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	g_autofree guint8 *buffer = g_malloc(CHUNK_BLOCKS * BLOCK_SIZE);
+	guint8 digest[DIGEST_SIZE];
+	GError *error = NULL;
+	guint64 first, count, i;
+	gint chunk;
+
+	while (!g_atomic_int_get(&v->failed)) {
+		chunk = g_atomic_int_add(&v->next_chunk, 1);
+		if (chunk >= v->chunks)
+			break;
+		if (g_cancellable_set_error_if_cancelled(v->cancellable, &error)) {
+			fail(v, error);
+			break;
+		}
+
+		first = (guint64)chunk * CHUNK_BLOCKS;
+		count = MIN(CHUNK_BLOCKS, v->data_blocks - first);
+		if (!bundle_file_read_at(v->fd, buffer, count * BLOCK_SIZE,
+		                         first * BLOCK_SIZE, v->path, &error)) {
+			fail(v, error);
+			break;
+		}
+
+		for (i = 0; i < count; i++) {
+			hash_block(checksum, v, buffer + i * BLOCK_SIZE, digest);
+			if (memcmp(digest, v->hashes + (first + i) * DIGEST_SIZE,
+			           DIGEST_SIZE) != 0) {
+				fail(v, g_error_new(VERITY_ERROR, VERITY_ERROR_CORRUPT,
+				                    "%s: data block %" G_GUINT64_FORMAT
+				                    " does not match the hash tree",
+				                    v->path, first + i));
+				return NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Checks the levels above level 0 and the root hash
+ *
+ * @param[in] Verification struct
+ * @param[in] hash tree
+ * @param[in] offset of each level in the tree
+ * @param[in] number of blocks of each level
+ * @param[in] number of levels
+ * @param[in] root hash
+ * @param[out] error
+ * @return TRUE if the tree is consistent
+ */
+static gboolean
+check_tree(const Verification *v, const guint8 *tree,
+           const guint64 *offsets, const guint64 *blocks, guint levels,
+           const guint8 *root, GError **error)
+{
+	g_autoptr(GChecksum) checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	guint8 digest[DIGEST_SIZE];
+	guint64 b;
+	guint level;
+
+	for (level = 1; level < levels; level++) {
+		for (b = 0; b < blocks[level - 1]; b++) {
+			hash_block(checksum, v, tree + offsets[level - 1] + b * BLOCK_SIZE,
+			           digest);
+			if (memcmp(digest, tree + offsets[level] + b * DIGEST_SIZE,
+			           DIGEST_SIZE) != 0)
+				goto corrupt;
+		}
+	}
+
+	hash_block(checksum, v, tree + offsets[levels - 1], digest);
+	if (memcmp(digest, root, DIGEST_SIZE) == 0)
+		return TRUE;
+
+ corrupt:
+	g_set_error(error, VERITY_ERROR, VERITY_ERROR_CORRUPT,
+	            "%s: hash tree does not match the root hash", v->path);
+	return FALSE;
+}
+
+/**
+ * @brief Checks a verity bundle against the hash tree of its manifest
+ *
+ * @param[in] path to the bundle
+ * @param[in] number of threads hashing the image, 0 = one per processor
+ * @param[in] cancellable
+ * @param[out] error, VERITY_ERROR_UNSUPPORTED for other bundle formats,
+ *             VERITY_ERROR_CORRUPT for mismatches or G_IO_ERROR
+ * @return TRUE if the image and the hash tree match the root hash
+ */
+gboolean
+verity_prevalidate(const gchar *path,
+                   guint threads,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+	g_autoptr(GBytes) signature = NULL;
+	g_autoptr(GPtrArray) workers = g_ptr_array_new();
+	g_autofree gchar *format = NULL;
+	g_autofree gchar *hash = NULL;
+	g_autofree gchar *salt = NULL;
+	g_autofree gchar *tree_size = NULL;
+	g_autofree guint8 *tree = NULL;
+	guint8 root[DIGEST_SIZE];
+	guint64 offsets[MAX_LEVELS];
+	guint64 blocks[MAX_LEVELS];
+	guint64 file_size, verity_size, data_size, total;
+	Verification v = { 0 };
+	gboolean res = FALSE;
+	gssize salt_size;
+	guint levels, i;
+	gint errsv;
+
+	if (!bundle_file_read_signature(path, &file_size, &signature, error))
+		return FALSE;
+
+	format = bundle_file_manifest_value(signature, "format");
+	if (g_strcmp0(format, "verity") != 0) {
+		g_set_error(error, VERITY_ERROR, VERITY_ERROR_UNSUPPORTED,
+		            "%s is no verity bundle", path);
+		return FALSE;
+	}
+	hash = bundle_file_manifest_value(signature, "verity-hash");
+	salt = bundle_file_manifest_value(signature, "verity-salt");
+	tree_size = bundle_file_manifest_value(signature, "verity-size");
+	if (hash == NULL || salt == NULL || tree_size == NULL ||
+	    decode_hex(hash, root, sizeof(root)) != DIGEST_SIZE ||
+	    (salt_size = decode_hex(salt, v.salt, sizeof(v.salt))) < 0 ||
+	    !g_ascii_string_to_unsigned(tree_size, 10, BLOCK_SIZE, MAX_TREE_SIZE,
+	                                &verity_size, NULL))
+		goto unsupported;
+	v.salt_size = salt_size;
+
+	/* the image is followed by the tree, the signature and its size */
+	total = verity_size + g_bytes_get_size(signature) + sizeof(guint64);
+	if (file_size <= total)
+		goto unsupported;
+	data_size = file_size - total;
+	if (data_size % BLOCK_SIZE)
+		goto unsupported;
+	v.data_blocks = data_size / BLOCK_SIZE;
+
+	/* layout of the tree, level 0 hashes the image */
+	levels = 0;
+	total = 0;
+	do {
+		if (levels == MAX_LEVELS)
+			goto unsupported;
+		blocks[levels] = (levels ? blocks[levels - 1] : v.data_blocks);
+		blocks[levels] = (blocks[levels] + HASHES_PER_BLOCK - 1) / HASHES_PER_BLOCK;
+		total += blocks[levels] * BLOCK_SIZE;
+		levels++;
+	} while (blocks[levels - 1] > 1);
+	if (total != verity_size)
+		goto unsupported;
+
+	/* the highest level is stored first */
+	offsets[levels - 1] = 0;
+	for (i = levels - 1; i > 0; i--)
+		offsets[i - 1] = offsets[i] + blocks[i] * BLOCK_SIZE;
+
+	v.path = path;
+	v.cancellable = cancellable;
+	v.fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (v.fd < 0) {
+		errsv = errno;
+		g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errsv),
+		            "Failed to open %s: %s", path, g_strerror(errsv));
+		return FALSE;
+	}
+	posix_fadvise(v.fd, 0, data_size + verity_size, POSIX_FADV_SEQUENTIAL);
+
+	tree = g_malloc(verity_size);
+	if (!bundle_file_read_at(v.fd, tree, verity_size, data_size, path, error) ||
+	    !check_tree(&v, tree, offsets, blocks, levels, root, error))
+		goto out;
+
+	/* hash the image in parallel, each worker takes the next chunk */
+	v.hashes = tree + offsets[0];
+	v.chunks = (v.data_blocks + CHUNK_BLOCKS - 1) / CHUNK_BLOCKS;
+	if (threads == 0)
+		threads = g_get_num_processors();
+	threads = CLAMP(threads, 1, (guint)v.chunks);
+
+	g_mutex_init(&v.lock);
+	for (i = 1; i < threads; i++)
+		g_ptr_array_add(workers, g_thread_new("verity", check_chunks, &v));
+	check_chunks(&v);
+	for (i = 0; i < workers->len; i++)
+		g_thread_join(g_ptr_array_index(workers, i));
+	g_mutex_clear(&v.lock);
+
+	if (v.error) {
+		g_propagate_error(error, v.error);
+		goto out;
+	}
+	res = TRUE;
+	goto out;
+
+ unsupported:
+	g_set_error(error, VERITY_ERROR, VERITY_ERROR_UNSUPPORTED,
+	            "%s: unknown verity layout", path);
+	return FALSE;
+ out:
+	close(v.fd);
+	return res;
+}